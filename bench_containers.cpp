@@ -0,0 +1,174 @@
+#include "pool_allocator.h"
+
+#include <algorithm>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+namespace {
+
+constexpr auto pool_size = 64 * 1024 * 1024;
+
+// Where a benchmark's containers get their nodes from. allocator<T>() hands
+// out an allocator for T.
+struct std_allocation {
+    template<typename T>
+    using type = std::allocator<T>;
+
+    template<typename T>
+    type<T> allocator() { return {}; }
+};
+
+struct good_pool_allocation {
+    template<typename T>
+    using type = pools::good_pool_allocator<T>;
+
+    struct good_pool *p{pool_create(pool_size)};
+    ~good_pool_allocation() { pool_destroy(p); }
+
+    template<typename T>
+    type<T> allocator() { return type<T>{p}; }
+};
+
+struct pool2_allocation {
+    template<typename T>
+    using type = pools::pool2_allocator<T>;
+
+    struct pool2 *p{pool2_create(pool_size)};
+    ~pool2_allocation() { pool2_destroy(p); }
+
+    template<typename T>
+    type<T> allocator() { return type<T>{p}; }
+};
+
+// The same pool behind std::pmr, which adds a virtual call per allocation.
+struct pmr_good_pool_allocation {
+    template<typename T>
+    using type = std::pmr::polymorphic_allocator<T>;
+
+    struct good_pool *p{pool_create(pool_size)};
+    pools::good_pool_resource resource{p};
+    ~pmr_good_pool_allocation() { pool_destroy(p); }
+
+    template<typename T>
+    type<T> allocator() { return type<T>{&resource}; }
+};
+
+std::vector<int> shuffled_keys(int n) {
+    std::vector<int> keys(n);
+    for (int i = 0; i < n; ++i) {
+        keys[i] = i;
+    }
+    std::shuffle(keys.begin(), keys.end(), std::minstd_rand());
+    return keys;
+}
+
+// Builds a list, walks it and clears it again.
+template<typename Allocation>
+void list_build_walk(benchmark::State &state) {
+    using allocator = typename Allocation::template type<int>;
+    const auto n = static_cast<int>(state.range(0));
+    Allocation a{};
+    std::list<int, allocator> l{a.template allocator<int>()};
+
+    for (auto _ : state) {
+        for (int i = 0; i < n; ++i) {
+            l.push_back(i);
+        }
+        long sum = 0;
+        for (int i : l) {
+            sum += i;
+        }
+        benchmark::DoNotOptimize(sum);
+        l.clear();
+    }
+
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Inserts keys in random order, looks all of them up and erases them.
+template<typename Allocation>
+void map_insert_erase(benchmark::State &state) {
+    using value = std::pair<const int, int>;
+    using allocator = typename Allocation::template type<value>;
+    const auto keys = shuffled_keys(static_cast<int>(state.range(0)));
+    Allocation a{};
+    std::map<int, int, std::less<int>, allocator> m{
+            a.template allocator<value>()};
+
+    for (auto _ : state) {
+        for (int k : keys) {
+            m.emplace(k, k);
+        }
+        long sum = 0;
+        for (int k : keys) {
+            sum += m.find(k)->second;
+        }
+        benchmark::DoNotOptimize(sum);
+        for (int k : keys) {
+            m.erase(k);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+template<typename Allocation>
+void unordered_map_insert_erase(benchmark::State &state) {
+    using value = std::pair<const int, int>;
+    using allocator = typename Allocation::template type<value>;
+    const auto keys = shuffled_keys(static_cast<int>(state.range(0)));
+    Allocation a{};
+    std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+            allocator> m{0, std::hash<int>{}, std::equal_to<int>{},
+            a.template allocator<value>()};
+
+    for (auto _ : state) {
+        for (int k : keys) {
+            m.emplace(k, k);
+        }
+        long sum = 0;
+        for (int k : keys) {
+            sum += m.find(k)->second;
+        }
+        benchmark::DoNotOptimize(sum);
+        for (int k : keys) {
+            m.erase(k);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+} // namespace
+
+BENCHMARK_TEMPLATE(list_build_walk, std_allocation)->Arg(1024)->Arg(65536);
+BENCHMARK_TEMPLATE(list_build_walk, good_pool_allocation)
+        ->Arg(1024)->Arg(65536);
+BENCHMARK_TEMPLATE(list_build_walk, pool2_allocation)->Arg(1024)->Arg(65536);
+BENCHMARK_TEMPLATE(list_build_walk, pmr_good_pool_allocation)
+        ->Arg(1024)->Arg(65536);
+
+BENCHMARK_TEMPLATE(map_insert_erase, std_allocation)->Arg(1024)->Arg(65536);
+BENCHMARK_TEMPLATE(map_insert_erase, good_pool_allocation)
+        ->Arg(1024)->Arg(65536);
+BENCHMARK_TEMPLATE(map_insert_erase, pool2_allocation)->Arg(1024)->Arg(65536);
+BENCHMARK_TEMPLATE(map_insert_erase, pmr_good_pool_allocation)
+        ->Arg(1024)->Arg(65536);
+
+BENCHMARK_TEMPLATE(unordered_map_insert_erase, std_allocation)
+        ->Arg(1024)->Arg(65536);
+BENCHMARK_TEMPLATE(unordered_map_insert_erase, good_pool_allocation)
+        ->Arg(1024)->Arg(65536);
+BENCHMARK_TEMPLATE(unordered_map_insert_erase, pool2_allocation)
+        ->Arg(1024)->Arg(65536);
+BENCHMARK_TEMPLATE(unordered_map_insert_erase, pmr_good_pool_allocation)
+        ->Arg(1024)->Arg(65536);
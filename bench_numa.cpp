@@ -0,0 +1,198 @@
+#include "numa_pool.h"
+#include "numa_util.h"
+#include "pool2.h"
+
+#include <sched.h>
+
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+namespace {
+
+constexpr size_t pool_size = 256 * 1024 * 1024;
+
+// Keeps the thread on the CPU it's running on, so "local" stays local.
+int pin_to_current_cpu() {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(sched_getcpu(), &cpus);
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+    return numa_util_current_node();
+}
+
+// The node the pool is on, relative to the thread. Remote runs are skipped
+// on machines with a single node.
+enum placement { local, remote };
+
+template<placement Placement>
+struct good_pool_on_node {
+    struct good_pool *p;
+    explicit good_pool_on_node(int node)
+            : p{pool_create_on_node(pool_size, node)} {}
+    ~good_pool_on_node() { pool_destroy(p); }
+    void *alloc(size_t sz) { return pool_alloc(p, sz); }
+    void free(void *ptr) { pool_free(p, ptr); }
+};
+
+template<placement Placement>
+struct pool2_on_node {
+    struct pool2 *p;
+    explicit pool2_on_node(int node)
+            : p{pool2_create_on_node(pool_size, node, 0)} {}
+    ~pool2_on_node() { pool2_destroy(p); }
+    void *alloc(size_t sz) { return pool2_alloc(p, sz); }
+    void free(void *ptr) { pool2_free(p, ptr); }
+};
+
+template<template<placement> class Pool, placement Placement>
+bool make_pool(
+        benchmark::State &state,
+        std::unique_ptr<Pool<Placement>> &pool) {
+    const int node = pin_to_current_cpu();
+    const int nodes = numa_util_nodes();
+    if (Placement == remote && nodes < 2) {
+        state.SkipWithError("needs a second NUMA node");
+        return false;
+    }
+
+    pool.reset(new Pool<Placement>{
+            Placement == local ? node : (node + 1) % nodes});
+    return true;
+}
+
+struct node {
+    node *next;
+    char payload[56];
+};
+
+// Follows a linked list of cache-line sized nodes in random order, which
+// is bound by memory latency.
+template<template<placement> class Pool, placement Placement>
+void pointer_chase(benchmark::State &state) {
+    std::unique_ptr<Pool<Placement>> pool{};
+    if (!make_pool(state, pool)) return;
+
+    const auto count = static_cast<size_t>(state.range(0));
+    std::vector<node *> nodes(count);
+    for (auto &n : nodes) {
+        n = static_cast<node *>(pool->alloc(sizeof(node)));
+    }
+    std::vector<node *> order{nodes};
+    std::shuffle(order.begin(), order.end(), std::minstd_rand());
+    for (size_t i = 0; i < count; ++i) {
+        order[i]->next = order[(i + 1) % count];
+    }
+
+    node *n = order[0];
+    for (auto _ : state) {
+        for (size_t i = 0; i < count; ++i) {
+            n = n->next;
+        }
+        benchmark::DoNotOptimize(n);
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+
+    for (auto *ptr : nodes) {
+        pool->free(ptr);
+    }
+}
+
+// Streams through one big block, which is bound by memory bandwidth.
+template<template<placement> class Pool, placement Placement>
+void stream(benchmark::State &state) {
+    std::unique_ptr<Pool<Placement>> pool{};
+    if (!make_pool(state, pool)) return;
+
+    const auto size = static_cast<size_t>(state.range(0));
+    auto *data = static_cast<uint64_t *>(pool->alloc(size));
+    memset(data, 1, size);
+
+    for (auto _ : state) {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < size / sizeof(*data); ++i) {
+            sum += data[i];
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+
+    pool->free(data);
+}
+
+// Threads allocate, touch and free small blocks. A numa_pool gives every
+// thread memory from its own node, a single pool puts it all on node 0.
+struct single_node_pool {
+    struct good_pool *p{pool_create_shared_on_node(pool_size, 0)};
+    ~single_node_pool() { pool_destroy(p); }
+    void *alloc(size_t sz) { return pool_alloc(p, sz); }
+    void free(void *ptr) { pool_free(p, ptr); }
+};
+
+struct per_node_pool {
+    struct numa_pool *p{numa_pool_create(pool_size)};
+    ~per_node_pool() { numa_pool_destroy(p); }
+    void *alloc(size_t sz) { return numa_pool_alloc(p, sz); }
+    void free(void *ptr) { numa_pool_free(p, ptr); }
+};
+
+// Threads that used a shared pool hand their caches back to it as they
+// exit, so the pool is made before the threads start and destroyed after
+// they've all been joined.
+template<typename Pool>
+Pool *touched_pool;
+
+template<typename Pool>
+void create_touched_pool(const benchmark::State &) {
+    touched_pool<Pool> = new Pool{};
+}
+
+template<typename Pool>
+void destroy_touched_pool(const benchmark::State &) {
+    delete touched_pool<Pool>;
+    touched_pool<Pool> = nullptr;
+}
+
+template<typename Pool>
+void threads_touch(benchmark::State &state) {
+    Pool *pool = touched_pool<Pool>;
+    constexpr auto burst = 256;
+    void *ptrs[burst];
+
+    for (auto _ : state) {
+        for (auto &ptr : ptrs) {
+            ptr = pool->alloc(256);
+            memset(ptr, 1, 256);
+        }
+        for (auto *ptr : ptrs) {
+            pool->free(ptr);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * burst);
+}
+
+} // namespace
+
+BENCHMARK_TEMPLATE(pointer_chase, good_pool_on_node, local)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(pointer_chase, good_pool_on_node, remote)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(pointer_chase, pool2_on_node, local)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(pointer_chase, pool2_on_node, remote)->Arg(1 << 20);
+
+BENCHMARK_TEMPLATE(stream, good_pool_on_node, local)->Arg(64 << 20);
+BENCHMARK_TEMPLATE(stream, good_pool_on_node, remote)->Arg(64 << 20);
+BENCHMARK_TEMPLATE(stream, pool2_on_node, local)->Arg(64 << 20);
+BENCHMARK_TEMPLATE(stream, pool2_on_node, remote)->Arg(64 << 20);
+
+BENCHMARK_TEMPLATE(threads_touch, single_node_pool)
+        ->Setup(create_touched_pool<single_node_pool>)
+        ->Teardown(destroy_touched_pool<single_node_pool>)
+        ->ThreadPerCpu();
+BENCHMARK_TEMPLATE(threads_touch, per_node_pool)
+        ->Setup(create_touched_pool<per_node_pool>)
+        ->Teardown(destroy_touched_pool<per_node_pool>)
+        ->ThreadPerCpu();
@@ -0,0 +1,392 @@
+#include "good_pool.h"
+#include "pool2.h"
+#include "static_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+namespace {
+
+constexpr auto pool_size = 64 * 1024 * 1024;
+
+struct good_pool_allocator {
+    struct good_pool *p{pool_create(pool_size)};
+    ~good_pool_allocator() { pool_destroy(p); }
+    void *alloc(size_t sz) { return pool_alloc(p, sz); }
+    void free(void *ptr) { pool_free(p, ptr); }
+    size_t alloc_batch(size_t sz, size_t n, void **out) {
+        return pool_alloc_batch(p, sz, n, out);
+    }
+    void free_batch(void **ptrs, size_t n) { pool_free_batch(p, ptrs, n); }
+};
+
+// Merges freed blocks lazily instead of as they're freed.
+struct deferred_good_pool_allocator : good_pool_allocator {
+    deferred_good_pool_allocator() { pool_set_deferred_frees(p, 1024); }
+};
+
+struct shared_good_pool_allocator {
+    struct good_pool *p{pool_create_shared(pool_size)};
+    ~shared_good_pool_allocator() { pool_destroy(p); }
+    void *alloc(size_t sz) { return pool_alloc(p, sz); }
+    void free(void *ptr) { pool_free(p, ptr); }
+};
+
+struct pool2_allocator {
+    struct pool2 *p{pool2_create(pool_size)};
+    ~pool2_allocator() { pool2_destroy(p); }
+    void *alloc(size_t sz) { return pool2_alloc(p, sz); }
+    void free(void *ptr) { pool2_free(p, ptr); }
+    size_t alloc_batch(size_t sz, size_t n, void **out) {
+        return pool2_alloc_batch(p, sz, n, out);
+    }
+    void free_batch(void **ptrs, size_t n) { pool2_free_batch(p, ptrs, n); }
+};
+
+// pool2 has no thread-safe mode, so it's used the way callers have to use
+// it today: behind a mutex.
+struct locked_pool2_allocator {
+    pool2_allocator pool{};
+    std::mutex lock{};
+    void *alloc(size_t sz) {
+        std::lock_guard<std::mutex> guard{lock};
+        return pool.alloc(sz);
+    }
+    void free(void *ptr) {
+        std::lock_guard<std::mutex> guard{lock};
+        pool.free(ptr);
+    }
+};
+
+// Lives in static storage and rounds sizes up to power of two classes.
+struct static_pool_allocator {
+    inline static pools::static_pool<pool_size, 16, 32, 64, 128, 256, 512,
+            1024> pool{};
+    void *alloc(size_t sz) { return pool.alloc(sz); }
+    void free(void *ptr) { pool.free(ptr); }
+};
+
+struct malloc_allocator {
+    void *alloc(size_t sz) { return std::malloc(sz); }
+    void free(void *ptr) { std::free(ptr); }
+};
+
+// Times every 64th operation and reports latency percentiles as counters.
+// Timing every operation would mostly measure the clock.
+class latency_sampler {
+public:
+    template<typename F>
+    auto operator()(F &&f) {
+        if (++ops_ % 64 != 0) return f();
+
+        const auto start = std::chrono::steady_clock::now();
+        auto result = f();
+        const auto end = std::chrono::steady_clock::now();
+        samples_.push_back(
+                std::chrono::duration<double, std::nano>(end - start).count());
+        return result;
+    }
+
+    void report(benchmark::State &state) {
+        state.SetItemsProcessed(ops_);
+        if (samples_.empty()) return;
+
+        std::sort(samples_.begin(), samples_.end());
+        auto percentile = [this](double p) {
+            return samples_[static_cast<size_t>(p * (samples_.size() - 1))];
+        };
+        state.counters["p50_ns"] = percentile(0.5);
+        state.counters["p99_ns"] = percentile(0.99);
+        state.counters["p999_ns"] = percentile(0.999);
+    }
+
+private:
+    int64_t ops_{};
+    std::vector<double> samples_{};
+};
+
+// Frees return nothing, so they're wrapped to fit latency_sampler.
+template<typename Allocator>
+bool timed_free(latency_sampler &sample, Allocator &a, void *ptr) {
+    return sample([&] {
+        a.free(ptr);
+        return true;
+    });
+}
+
+// Allocates a burst of blocks and frees them in reverse order.
+template<typename Allocator>
+void lifo_churn(benchmark::State &state) {
+    constexpr auto burst = 64;
+    const auto size = static_cast<size_t>(state.range(0));
+    Allocator a{};
+    latency_sampler sample{};
+    void *ptrs[burst];
+
+    for (auto _ : state) {
+        for (auto &ptr : ptrs) {
+            ptr = sample([&] { return a.alloc(size); });
+        }
+        for (int i = burst - 1; i >= 0; --i) {
+            timed_free(sample, a, ptrs[i]);
+        }
+    }
+
+    sample.report(state);
+}
+
+// Random sizes and lifetimes, like the randoms_allocs tests.
+template<typename Allocator>
+void random_sizes(benchmark::State &state) {
+    constexpr auto max_item_size = 1024;
+    constexpr auto max_live = 16 * 1024;
+    Allocator a{};
+    latency_sampler sample{};
+    auto rng{std::minstd_rand()};
+    std::vector<void *> live{};
+    live.reserve(max_live);
+
+    for (auto _ : state) {
+        if (live.empty() || (live.size() < max_live && rng() % 2)) {
+            void *ptr = sample([&] { return a.alloc(rng() % max_item_size); });
+            if (ptr) {
+                live.push_back(ptr);
+                continue;
+            }
+        }
+
+        const auto i = rng() % live.size();
+        timed_free(sample, a, live[i]);
+        live[i] = live.back();
+        live.pop_back();
+    }
+
+    for (auto ptr : live) {
+        a.free(ptr);
+    }
+
+    sample.report(state);
+}
+
+// A long-lived population of objects is interleaved with short-lived ones
+// that are freed before measuring, so the timed allocations run against a
+// fragmented heap.
+template<typename Allocator>
+void fragmented(benchmark::State &state) {
+    constexpr auto long_lived = 64 * 1024;
+    constexpr auto max_item_size = 512;
+    Allocator a{};
+    latency_sampler sample{};
+    auto rng{std::minstd_rand()};
+
+    std::vector<void *> survivors{};
+    std::vector<void *> garbage{};
+    for (int i = 0; i < long_lived; ++i) {
+        survivors.push_back(a.alloc(rng() % max_item_size));
+        garbage.push_back(a.alloc(rng() % max_item_size));
+    }
+    for (auto ptr : garbage) {
+        a.free(ptr);
+    }
+
+    std::vector<void *> ptrs(32);
+    for (auto _ : state) {
+        for (auto &ptr : ptrs) {
+            ptr = sample([&] { return a.alloc(rng() % max_item_size); });
+        }
+        for (auto ptr : ptrs) {
+            timed_free(sample, a, ptr);
+        }
+    }
+
+    for (auto ptr : survivors) {
+        a.free(ptr);
+    }
+
+    sample.report(state);
+}
+
+// Allocates bursts of objects and frees them in the same order, one call per
+// object.
+template<typename Allocator>
+void burst_loop(benchmark::State &state) {
+    constexpr auto size = 64;
+    const auto burst = static_cast<size_t>(state.range(0));
+    Allocator a{};
+    std::vector<void *> ptrs(burst);
+
+    for (auto _ : state) {
+        for (auto &ptr : ptrs) {
+            ptr = a.alloc(size);
+        }
+        for (auto ptr : ptrs) {
+            a.free(ptr);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * burst);
+}
+
+// The same bursts through the batch calls.
+template<typename Allocator>
+void burst_batch(benchmark::State &state) {
+    constexpr auto size = 64;
+    const auto burst = static_cast<size_t>(state.range(0));
+    Allocator a{};
+    std::vector<void *> ptrs(burst);
+
+    for (auto _ : state) {
+        const auto n = a.alloc_batch(size, burst, ptrs.data());
+        a.free_batch(ptrs.data(), n);
+    }
+
+    state.SetItemsProcessed(state.iterations() * burst);
+}
+
+// Allocates a request's worth of small objects and throws them all away at
+// once, either with pool_free or by releasing a scratch region mark.
+void request_scope_free(benchmark::State &state) {
+    constexpr auto objects = 64;
+    struct good_pool *p = pool_create(pool_size);
+    void *ptrs[objects];
+
+    for (auto _ : state) {
+        for (auto &ptr : ptrs) {
+            ptr = pool_alloc(p, 48);
+        }
+        for (auto ptr : ptrs) {
+            pool_free(p, ptr);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * objects);
+    pool_destroy(p);
+}
+
+void request_scope_scratch(benchmark::State &state) {
+    constexpr auto objects = 64;
+    struct good_pool *p = pool_create(pool_size);
+    void *ptrs[objects];
+
+    // The first chunk stays around between requests.
+    pool_alloc_scratch(p, 1);
+    const struct pool_region_mark mark = pool_mark(p);
+    for (auto _ : state) {
+        for (auto &ptr : ptrs) {
+            ptr = pool_alloc_scratch(p, 48);
+        }
+        benchmark::ClobberMemory();
+        pool_release_to(p, mark);
+    }
+
+    state.SetItemsProcessed(state.iterations() * objects);
+    pool_destroy(p);
+}
+
+// A single-producer single-consumer ring used to hand blocks to the
+// consumer thread.
+class handoff_ring {
+public:
+    bool push(void *ptr) {
+        const auto head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == slots_.size()) {
+            return false;
+        }
+        slots_[head % slots_.size()] = ptr;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(void *&ptr) {
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        ptr = slots_[tail % slots_.size()];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<void *> slots_ = std::vector<void *>(4096);
+    alignas(64) std::atomic<size_t> head_{};
+    alignas(64) std::atomic<size_t> tail_{};
+};
+
+// The benchmark thread allocates and another thread frees everything.
+template<typename Allocator>
+void producer_consumer(benchmark::State &state) {
+    const auto size = static_cast<size_t>(state.range(0));
+    Allocator a{};
+    latency_sampler sample{};
+    handoff_ring ring{};
+    std::atomic<bool> done{false};
+
+    std::thread consumer([&] {
+        void *ptr;
+        for (;;) {
+            if (ring.pop(ptr)) {
+                a.free(ptr);
+            } else if (done.load(std::memory_order_acquire)) {
+                if (!ring.pop(ptr)) return;
+                a.free(ptr);
+            }
+        }
+    });
+
+    for (auto _ : state) {
+        void *ptr = sample([&] { return a.alloc(size); });
+        if (!ptr) continue;
+        while (!ring.push(ptr)) {
+            std::this_thread::yield();
+        }
+    }
+
+    done.store(true, std::memory_order_release);
+    consumer.join();
+
+    sample.report(state);
+}
+
+BENCHMARK_TEMPLATE(lifo_churn, good_pool_allocator)->Arg(16)->Arg(256);
+BENCHMARK_TEMPLATE(lifo_churn, deferred_good_pool_allocator)
+        ->Arg(16)
+        ->Arg(256);
+BENCHMARK_TEMPLATE(lifo_churn, pool2_allocator)->Arg(16)->Arg(256);
+BENCHMARK_TEMPLATE(lifo_churn, static_pool_allocator)->Arg(16)->Arg(256);
+BENCHMARK_TEMPLATE(lifo_churn, malloc_allocator)->Arg(16)->Arg(256);
+
+BENCHMARK_TEMPLATE(random_sizes, good_pool_allocator);
+BENCHMARK_TEMPLATE(random_sizes, deferred_good_pool_allocator);
+BENCHMARK_TEMPLATE(random_sizes, pool2_allocator);
+BENCHMARK_TEMPLATE(random_sizes, static_pool_allocator);
+BENCHMARK_TEMPLATE(random_sizes, malloc_allocator);
+
+BENCHMARK_TEMPLATE(fragmented, good_pool_allocator);
+BENCHMARK_TEMPLATE(fragmented, deferred_good_pool_allocator);
+BENCHMARK_TEMPLATE(fragmented, pool2_allocator);
+BENCHMARK_TEMPLATE(fragmented, malloc_allocator);
+
+BENCHMARK_TEMPLATE(burst_loop, good_pool_allocator)->Arg(32)->Arg(256);
+BENCHMARK_TEMPLATE(burst_batch, good_pool_allocator)->Arg(32)->Arg(256);
+BENCHMARK_TEMPLATE(burst_loop, pool2_allocator)->Arg(32)->Arg(256);
+BENCHMARK_TEMPLATE(burst_batch, pool2_allocator)->Arg(32)->Arg(256);
+BENCHMARK_TEMPLATE(burst_loop, malloc_allocator)->Arg(32)->Arg(256);
+
+BENCHMARK(request_scope_free);
+BENCHMARK(request_scope_scratch);
+
+BENCHMARK_TEMPLATE(producer_consumer, shared_good_pool_allocator)->Arg(64);
+BENCHMARK_TEMPLATE(producer_consumer, locked_pool2_allocator)->Arg(64);
+BENCHMARK_TEMPLATE(producer_consumer, malloc_allocator)->Arg(64);
+
+} // namespace
@@ -0,0 +1,112 @@
+#include "fixed_pool.h"
+
+#include <stdatomic.h>
+#include <stdint.h> // uint32_t, uint64_t, UINT32_MAX
+#include <stdlib.h> // malloc, free, NULL
+
+// The head of the free stack packs the one-based index of the top block
+// together with a tag that's bumped on every update. A thread holding a
+// stale head will then fail its compare-and-swap even if the same block has
+// made it back to the top of the stack (the ABA problem).
+#define HEAD_INDEX(head) ((uint32_t)(head))
+#define HEAD_TAG(head) ((uint32_t)((head) >> 32))
+#define MAKE_HEAD(index, tag) (((uint64_t)(tag) << 32) | (uint32_t)(index))
+
+struct fixed_pool {
+    _Atomic uint64_t head;
+    size_t block_size;
+    size_t blocks;
+};
+
+#define BLOCKS_OFFSET ((sizeof(struct fixed_pool) + 7) / 8 * 8)
+
+static char *block_at(const struct fixed_pool *pool, uint32_t index) {
+    return (char *)pool + BLOCKS_OFFSET
+            + (size_t)(index - 1) * pool->block_size;
+}
+
+static uint32_t block_index(const struct fixed_pool *pool, const void *ptr) {
+    const size_t offset = (char *)ptr - (char *)pool - BLOCKS_OFFSET;
+    return offset / pool->block_size + 1;
+}
+
+// Free blocks store the index of the block below them in the stack.
+static _Atomic uint32_t *next_index(void *block) {
+    return block;
+}
+
+struct fixed_pool *fixed_pool_create(size_t block_size, size_t blocks) {
+    block_size += (8 - block_size % 8) % 8;
+    if (block_size < sizeof(uint32_t)) {
+        block_size = 8;
+    }
+
+    if (blocks == 0 || blocks >= UINT32_MAX) {
+        return NULL;
+    }
+
+    if (block_size > (SIZE_MAX - BLOCKS_OFFSET) / blocks) {
+        return NULL;
+    }
+
+    struct fixed_pool *pool = malloc(BLOCKS_OFFSET + block_size * blocks);
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->block_size = block_size;
+    pool->blocks = blocks;
+
+    for (uint32_t i = 1; i < blocks; ++i) {
+        atomic_init(next_index(block_at(pool, i)), i + 1);
+    }
+    atomic_init(next_index(block_at(pool, blocks)), 0);
+
+    atomic_init(&pool->head, MAKE_HEAD(1, 0));
+    return pool;
+}
+
+void fixed_pool_destroy(struct fixed_pool *pool) {
+    free(pool);
+}
+
+void *fixed_pool_alloc(struct fixed_pool *pool) {
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+    for (;;) {
+        const uint32_t index = HEAD_INDEX(head);
+        if (!index) {
+            return NULL;
+        }
+
+        // The block may be popped and scribbled over by another thread
+        // before we get to read it, but then the tag has moved on and the
+        // exchange below fails.
+        char *block = block_at(pool, index);
+        const uint32_t next =
+                atomic_load_explicit(next_index(block), memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(
+                    &pool->head,
+                    &head,
+                    MAKE_HEAD(next, HEAD_TAG(head) + 1),
+                    memory_order_acquire,
+                    memory_order_acquire)) {
+            return block;
+        }
+    }
+}
+
+void fixed_pool_free(struct fixed_pool *pool, void *ptr) {
+    if (!ptr) return;
+
+    const uint32_t index = block_index(pool, ptr);
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    do {
+        atomic_store_explicit(
+                next_index(ptr), HEAD_INDEX(head), memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(
+                &pool->head,
+                &head,
+                MAKE_HEAD(index, HEAD_TAG(head) + 1),
+                memory_order_release,
+                memory_order_relaxed));
+}
@@ -0,0 +1,24 @@
+#ifndef FIXED_POOL_H_
+#define FIXED_POOL_H_
+
+#include <stddef.h> // size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A pool of equally sized blocks. Allocating and freeing are lock-free and
+// safe to call from any number of threads at once.
+struct fixed_pool;
+
+struct fixed_pool *fixed_pool_create(size_t block_size, size_t blocks);
+void fixed_pool_destroy(struct fixed_pool *pool);
+
+void *fixed_pool_alloc(struct fixed_pool *pool);
+void fixed_pool_free(struct fixed_pool *pool, void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,193 +1,1277 @@
 #include "good_pool.h"
+#include "numa_util.h"
+#include "pool_trace_hooks.h"
 
+#include <limits.h> // CHAR_BIT
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h> // bool, true, false
+#include <stddef.h> // offsetof
+#include <stdint.h> // uint32_t, uintptr_t, UINT32_MAX
 #include <stdlib.h>
+#include <string.h> // memcpy, memset
+#include <sys/mman.h> // munmap
 
+// Free blocks are kept in TLSF-style segregated bins. The first level splits
+// sizes by power of two and the second level splits every power of two into
+// SL_INDEX_COUNT linear ranges. Small sizes get one bin per 8-byte step. A
+// bitmap per level keeps track of the non-empty bins, so looking up a block
+// that fits is a couple of bit scans no matter how many blocks are free.
+#define ALIGN_SIZE_LOG2 3
+#define ALIGN_SIZE (1 << ALIGN_SIZE_LOG2)
+
+#define SL_INDEX_COUNT_LOG2 4
+#define SL_INDEX_COUNT (1 << SL_INDEX_COUNT_LOG2)
+
+#define FL_INDEX_SHIFT (SL_INDEX_COUNT_LOG2 + ALIGN_SIZE_LOG2)
+#define FL_INDEX_COUNT (sizeof(size_t) * CHAR_BIT - FL_INDEX_SHIFT + 1)
+
+#define SMALL_BLOCK_SIZE (1 << FL_INDEX_SHIFT)
+
+#define BLOCK_FREE ((size_t)1)
+#define BLOCK_LAST ((size_t)2) // no blocks after this
+#define BLOCK_SIZE_MASK (~(size_t)(ALIGN_SIZE - 1))
+
+#ifdef GOOD_POOL_COMPACT_HEADERS
+// Compact headers keep sizes and free list links in 32 bits, which halves
+// the header. Links are offsets from the start of the pool, so the pool has
+// to fit in 4 GiB and can't grow arenas somewhere else in memory.
+typedef uint32_t block_word;
+typedef uint32_t block_link;
+#else
+typedef size_t block_word;
+typedef struct good_pool_item *block_link;
+#endif
+
+// Blocks carry boundary tags: while a block is free its size is also stored
+// in the header of the block following it, so both physical neighbours of a
+// block can be found in constant time. Neighbours only ever touch prev_sz,
+// so the sz of a block in use stays put until it's freed.
 struct good_pool_item {
+    union {
+        // The size of the previous block if it's free, 0 otherwise.
+        block_word prev_sz;
+        // Two free blocks are never adjacent, so a free block has no use for
+        // prev_sz and keeps its free list link there instead.
+        block_link next_free;
+    };
+    block_word sz;
+    // Only valid while the block is free, it overlaps the payload otherwise.
+    block_link prev_free;
+};
+
+#define BLOCK_HEADER_SIZE offsetof(struct good_pool_item, prev_free)
+#define BLOCK_MIN_SIZE \
+    ((sizeof(struct good_pool_item) + ALIGN_SIZE - 1) & BLOCK_SIZE_MASK)
+
+// Shared pools give every thread a cache of recently freed small blocks per
+// block size. Threads only take the pool lock to refill or drain a cache,
+// and then move CACHE_BATCH blocks at a time.
+#define CACHE_MAX_BLOCK_SIZE 256
+#define CACHE_CLASSES (CACHE_MAX_BLOCK_SIZE / ALIGN_SIZE + 1)
+#define CACHE_BATCH 16
+#define CACHE_LIMIT (CACHE_BATCH * 4)
+
+// Allocations, frees and failed allocations are counted separately by every
+// thread using a shared pool, so the counts don't need the pool lock.
+enum pool_count {
+    COUNT_ALLOCS,
+    COUNT_FREES,
+    COUNT_FAILURES,
+    COUNT_KINDS,
+};
+
+struct good_pool_cache {
+    struct good_pool *pool;
+    struct good_pool_cache *next;
+    _Atomic size_t counts[COUNT_KINDS];
+
+    unsigned count[CACHE_CLASSES];
+    // Cached blocks are still in use as far as the pool is concerned. They
+    // are linked through the first word of their payloads.
+    struct good_pool_item *blocks[CACHE_CLASSES];
+};
+
+// Arenas added when a growable pool runs out of memory. The trailer sits
+// right after the arena's last block, so it can be found from there.
+struct good_pool_arena {
+    struct good_pool_arena *next;
     size_t sz;
-    struct good_pool_item *next;
 };
 
+// Scratch allocations are bumped out of chunks the pool hands out as
+// ordinary blocks. Every chunk starts with a link to the one before it.
+#define REGION_CHUNK_SIZE (64 * 1024)
+
+struct good_pool_region {
+    struct good_pool_region *prev;
+    char *end;
+};
+
+#define REGION_HEADER_SIZE \
+    ((sizeof(struct good_pool_region) + ALIGN_SIZE - 1) & BLOCK_SIZE_MASK)
+
+// The pool's bookkeeping sits at the start of the memory it manages and the
+// first arena follows right after it.
 struct good_pool {
-    void *addr;
+    size_t sz;
+    bool owns_memory;
+    // Pools bound to a NUMA node map all of their arenas on that node.
+    bool on_node;
+    int node;
+
+    enum pool_growth growth;
+    size_t chunk;
+    size_t total_sz;
+    struct good_pool_arena *arenas;
 
-    struct good_pool_item *used;
-    struct good_pool_item *free;
+    struct good_pool_region *region;
+    char *region_top;
+    char *region_end;
+
+    // Kept up to date as blocks change hands, so the stats are cheap to read.
+    size_t free_sz;
+    size_t free_count;
+    size_t used_count;
+    size_t peak_allocated;
+    size_t counts[COUNT_KINDS];
+
+    size_t fl_bitmap;
+    unsigned sl_bitmap[FL_INDEX_COUNT];
+    struct good_pool_item *free[FL_INDEX_COUNT][SL_INDEX_COUNT];
+
+    // Small blocks freed into a pool that isn't shared can be set aside
+    // without merging them, and handed out again to allocations of the same
+    // size. They're merged once there are too many or memory runs out.
+    struct good_pool_cache deferred;
+    size_t deferred_count;
+    size_t deferred_budget;
+
+    bool shared;
+    pthread_mutex_t lock;
+    pthread_key_t cache_key;
+    struct good_pool_cache *caches;
 };
 
-static struct good_pool_item *first_fit(struct good_pool *p, size_t sz) {
-    for (struct good_pool_item *i = p->free; i != NULL; i = i->next) {
-        if (i->sz >= sz) {
-            return i;
-        }
+#define ARENA_OFFSET \
+    ((sizeof(struct good_pool) + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1))
+
+#ifdef GOOD_POOL_COMPACT_HEADERS
+#define POOL_MAX_SIZE ((size_t)UINT32_MAX - ARENA_OFFSET)
+#else
+#define POOL_MAX_SIZE (SIZE_MAX - ARENA_OFFSET)
+#endif
+
+static unsigned find_last_set(size_t word) {
+    return sizeof(unsigned long long) * CHAR_BIT - 1
+            - __builtin_clzll(word);
+}
+
+static unsigned find_first_set(size_t word) {
+    return __builtin_ctzll(word);
+}
+
+static size_t block_size(const struct good_pool_item *i) {
+    return i->sz & BLOCK_SIZE_MASK;
+}
+
+static void block_set_size(struct good_pool_item *i, size_t sz) {
+    i->sz = sz | (i->sz & ~BLOCK_SIZE_MASK);
+}
+
+static int block_is_free(const struct good_pool_item *i) {
+    return i->sz & BLOCK_FREE;
+}
+
+static int block_is_last(const struct good_pool_item *i) {
+    return i->sz & BLOCK_LAST;
+}
+
+static struct good_pool_item *next_block(const struct good_pool_item *i) {
+    return (void *)((char *)i + block_size(i));
+}
+
+static struct good_pool_item *first_block(const struct good_pool *p) {
+    return (void *)((char *)p + ARENA_OFFSET);
+}
+
+static struct good_pool_item *prev_block(const struct good_pool_item *i) {
+    return (void *)((char *)i - i->prev_sz);
+}
+
+static void mapping_insert(size_t sz, unsigned *fl, unsigned *sl) {
+    if (sz < SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = sz / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+    } else {
+        const unsigned msb = find_last_set(sz);
+        *fl = msb - FL_INDEX_SHIFT + 1;
+        *sl = (sz >> (msb - SL_INDEX_COUNT_LOG2)) ^ SL_INDEX_COUNT;
     }
+}
 
-    return NULL;
+// Rounds sz up to the next bin boundary so that any block in the bin found
+// is big enough and the bin doesn't have to be searched.
+static size_t round_up_to_bin(size_t sz) {
+    if (sz >= SMALL_BLOCK_SIZE) {
+        sz += ((size_t)1 << (find_last_set(sz) - SL_INDEX_COUNT_LOG2)) - 1;
+    }
+
+    return sz;
 }
 
-static void list_remove(
-        struct good_pool_item *head,
-        struct good_pool_item *remove) {
-    while (head->next && head->next != remove) head = head->next;
-    if (head->next == remove) head->next = remove->next;
+static void mapping_search(size_t sz, unsigned *fl, unsigned *sl) {
+    mapping_insert(round_up_to_bin(sz), fl, sl);
 }
 
-static void pool_remove_used(
+static struct good_pool_item *find_free(struct good_pool *p, size_t sz) {
+    unsigned fl, sl;
+    mapping_search(sz, &fl, &sl);
+    if (fl >= FL_INDEX_COUNT) return NULL;
+
+    unsigned sl_map = p->sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map) {
+        const size_t fl_map = p->fl_bitmap & (~(size_t)0 << (fl + 1));
+        if (!fl_map) return NULL;
+
+        fl = find_first_set(fl_map);
+        sl_map = p->sl_bitmap[fl];
+    }
+
+    return p->free[fl][find_first_set(sl_map)];
+}
+
+static struct good_pool_item *from_link(
+        const struct good_pool *p,
+        block_link link) {
+#ifdef GOOD_POOL_COMPACT_HEADERS
+    return link ? (void *)((char *)p + link) : NULL;
+#else
+    (void)p;
+    return link;
+#endif
+}
+
+static block_link to_link(
+        const struct good_pool *p,
+        struct good_pool_item *i) {
+#ifdef GOOD_POOL_COMPACT_HEADERS
+    return i ? (block_link)((char *)i - (char *)p) : 0;
+#else
+    (void)p;
+    return i;
+#endif
+}
+
+static void pool_insert_free(
         struct good_pool *p,
         struct good_pool_item *i) {
-    if (p->used == i) {
-        p->used = p->used->next;
-    } else {
-        list_remove(p->used, i);
+    unsigned fl, sl;
+    mapping_insert(block_size(i), &fl, &sl);
+
+    struct good_pool_item *next = p->free[fl][sl];
+    i->sz |= BLOCK_FREE;
+    i->prev_free = to_link(p, NULL);
+    i->next_free = to_link(p, next);
+    if (next) next->prev_free = to_link(p, i);
+
+    p->free[fl][sl] = i;
+    p->fl_bitmap |= (size_t)1 << fl;
+    p->sl_bitmap[fl] |= 1U << sl;
+    p->free_sz += block_size(i);
+    ++p->free_count;
+
+    if (!block_is_last(i)) {
+        next_block(i)->prev_sz = block_size(i);
     }
 }
 
 static void pool_remove_free(
         struct good_pool *p,
         struct good_pool_item *i) {
-    if (p->free == i) {
-        p->free = p->free->next;
+    unsigned fl, sl;
+    mapping_insert(block_size(i), &fl, &sl);
+
+    struct good_pool_item *next = from_link(p, i->next_free);
+    struct good_pool_item *prev = from_link(p, i->prev_free);
+    i->sz &= ~BLOCK_FREE;
+    if (next) next->prev_free = i->prev_free;
+    if (prev) {
+        prev->next_free = i->next_free;
     } else {
-        list_remove(p->free, i);
+        p->free[fl][sl] = next;
+        if (!next) {
+            p->sl_bitmap[fl] &= ~(1U << sl);
+            if (!p->sl_bitmap[fl]) p->fl_bitmap &= ~((size_t)1 << fl);
+        }
     }
-}
+    p->free_sz -= block_size(i);
+    --p->free_count;
 
-static struct good_pool_item *list_find(
-        struct good_pool_item *head,
-        struct good_pool_item *needle) {
-    if (head == needle) return head;
-    while (head->next && head->next != needle) head = head->next;
-    return head->next;
+    // The previous block of a free block is never free.
+    i->prev_sz = 0;
 }
 
 static void *to_external_ptr(struct good_pool_item *i) {
-    return ((char *)i) + sizeof(struct good_pool_item);
+    return ((char *)i) + BLOCK_HEADER_SIZE;
 }
 
 static struct good_pool_item *to_pool_ptr(void *ptr) {
-    return (void *)((char *)ptr - sizeof(struct good_pool_item));
+    return (void *)((char *)ptr - BLOCK_HEADER_SIZE);
 }
 
-static void pool_coalesce(struct good_pool *p) {
-    if (!p->free || !p->free->next) return;
+// Merges i with its free physical neighbours and returns the merged block.
+static struct good_pool_item *pool_coalesce(
+        struct good_pool *p,
+        struct good_pool_item *i) {
+    if (!block_is_last(i)) {
+        struct good_pool_item *next = next_block(i);
+        if (block_is_free(next)) {
+            pool_remove_free(p, next);
+            block_set_size(i, block_size(i) + block_size(next));
+            i->sz |= next->sz & BLOCK_LAST;
+        }
+    }
 
-    if (p->free > p->free->next) {
-        struct good_pool_item *tmp = p->free->next;
-        p->free->next = tmp->next;
-        tmp->next = p->free;
-        p->free = tmp;
+    if (i->prev_sz) {
+        struct good_pool_item *prev = prev_block(i);
+        pool_remove_free(p, prev);
+        block_set_size(prev, block_size(prev) + block_size(i));
+        prev->sz |= i->sz & BLOCK_LAST;
+        return prev;
     }
 
-    for (struct good_pool_item *i = p->free;
-            i->next != NULL && i->next->next != NULL;
-            i = i->next) {
-        if (i->next > i->next->next) {
-            struct good_pool_item *tmp = i->next->next;
-            i->next->next = tmp->next;
-            tmp->next = i->next;
-            i->next = tmp;
+    return i;
+}
+
+static size_t to_block_size(size_t sz) {
+    sz += (8 - sz % 8) % 8;
+    sz += BLOCK_HEADER_SIZE;
+    return sz < BLOCK_MIN_SIZE ? BLOCK_MIN_SIZE : sz;
+}
+
+static struct good_pool_item *arena_first_block(
+        const struct good_pool_arena *a) {
+    return (void *)((char *)a - a->sz);
+}
+
+static void arena_free(const struct good_pool *p, struct good_pool_arena *a) {
+    void *mem = arena_first_block(a);
+    if (p->on_node) {
+        munmap(mem, a->sz + sizeof(struct good_pool_arena));
+    } else {
+        free(mem);
+    }
+}
+
+#ifdef GOOD_POOL_COMPACT_HEADERS
+// Links can't reach memory outside of the pool, see pool_set_growth.
+static bool pool_grow(struct good_pool *p, size_t sz) {
+    (void)p;
+    (void)sz;
+    return false;
+}
+#else
+static void *arena_alloc(const struct good_pool *p, size_t sz) {
+    return p->on_node ? numa_util_map(sz, p->node) : malloc(sz);
+}
+
+static bool pool_grow(struct good_pool *p, size_t sz) {
+    size_t arena_sz =
+            p->growth == POOL_GROW_DOUBLE ? p->total_sz : p->chunk;
+
+    // find_free only looks in bins where every block is big enough.
+    sz = round_up_to_bin(sz);
+    if (arena_sz < sz) arena_sz = sz;
+    arena_sz = (arena_sz + ALIGN_SIZE - 1) & BLOCK_SIZE_MASK;
+    if (arena_sz > SIZE_MAX - sizeof(struct good_pool_arena)) return false;
+
+    struct good_pool_item *i =
+            arena_alloc(p, arena_sz + sizeof(struct good_pool_arena));
+    if (!i) return false;
+
+    struct good_pool_arena *a = (void *)((char *)i + arena_sz);
+    a->sz = arena_sz;
+    a->next = p->arenas;
+    p->arenas = a;
+    p->total_sz += arena_sz;
+
+    i->prev_sz = 0;
+    i->sz = arena_sz | BLOCK_LAST;
+    pool_insert_free(p, i);
+    return true;
+}
+#endif
+
+static void count_used(struct good_pool *p, size_t blocks) {
+    p->used_count += blocks;
+    if (p->total_sz - p->free_sz > p->peak_allocated) {
+        p->peak_allocated = p->total_sz - p->free_sz;
+    }
+}
+
+static void flush_deferred(struct good_pool *p);
+
+static struct good_pool_item *alloc_block(struct good_pool *p, size_t sz) {
+    struct good_pool_item *i = find_free(p, sz);
+    if (!i && p->deferred_count) {
+        flush_deferred(p);
+        i = find_free(p, sz);
+    }
+    if (!i) {
+        if (p->growth == POOL_GROW_NONE || !pool_grow(p, sz)) return NULL;
+        i = find_free(p, sz);
+    }
+
+    pool_remove_free(p, i);
+
+    if (block_size(i) >= sz + BLOCK_MIN_SIZE) {
+        struct good_pool_item *remainder = (void *)((char *)i + sz);
+        remainder->sz = (block_size(i) - sz) | (i->sz & BLOCK_LAST);
+        i->sz = sz;
+        pool_insert_free(p, remainder);
+    } else if (!block_is_last(i)) {
+        next_block(i)->prev_sz = 0;
+    }
+
+    count_used(p, 1);
+    return i;
+}
+
+// Splits up to n blocks of sz bytes off the free block i in one go and
+// returns how many it split off. What's left goes back as one free block.
+static size_t carve_blocks(
+        struct good_pool *p,
+        struct good_pool_item *i,
+        size_t sz,
+        size_t n,
+        void **out) {
+    pool_remove_free(p, i);
+    const size_t last = i->sz & BLOCK_LAST;
+    size_t left = block_size(i);
+    size_t count = 0;
+
+    // The previous block of a free block is never free, so none of the
+    // carved blocks has a free block before it.
+    struct good_pool_item *block = i;
+    for (; count < n && left >= sz; ++count, left -= sz) {
+        block = (void *)((char *)i + count * sz);
+        block->prev_sz = 0;
+        block->sz = sz;
+        out[count] = to_external_ptr(block);
+    }
+
+    if (left >= BLOCK_MIN_SIZE) {
+        struct good_pool_item *remainder = next_block(block);
+        remainder->sz = left | last;
+        pool_insert_free(p, remainder);
+    } else {
+        block->sz = (sz + left) | last;
+        if (!last) next_block(block)->prev_sz = 0;
+    }
+
+    return count;
+}
+
+static size_t alloc_blocks(
+        struct good_pool *p,
+        size_t sz,
+        size_t n,
+        void **out) {
+    size_t count = 0;
+
+    while (count < n) {
+        // A block that fits the rest of the batch is carved up in one go.
+        const size_t rest = n - count <= SIZE_MAX / 2 / sz
+                ? (n - count) * sz
+                : sz;
+        struct good_pool_item *i = find_free(p, rest);
+        if (!i) i = find_free(p, sz);
+        if (!i && p->deferred_count) {
+            flush_deferred(p);
+            continue;
+        }
+        if (!i) {
+            if (p->growth == POOL_GROW_NONE) break;
+            if (!pool_grow(p, rest) && !pool_grow(p, sz)) break;
+            continue;
         }
+
+        count += carve_blocks(p, i, sz, n - count, out + count);
+    }
+
+    count_used(p, count);
+    return count;
+}
+
+static void free_block(struct good_pool *p, struct good_pool_item *i) {
+    --p->used_count;
+    pool_insert_free(p, pool_coalesce(p, i));
+}
+
+static size_t free_blocks(struct good_pool *p, void **ptrs, size_t n) {
+    size_t freed = 0;
+
+    for (size_t k = 0; k < n;) {
+        if (!ptrs[k]) {
+            ++k;
+            continue;
+        }
+
+        // Blocks that follow each other in memory are merged before they're
+        // freed, so a run of them is only coalesced once.
+        struct good_pool_item *run = to_pool_ptr(ptrs[k++]);
+        size_t blocks = 1;
+        while (k < n && ptrs[k] && !block_is_last(run)
+                && to_pool_ptr(ptrs[k]) == next_block(run)) {
+            struct good_pool_item *next = next_block(run);
+            block_set_size(run, block_size(run) + block_size(next));
+            run->sz |= next->sz & BLOCK_LAST;
+            ++blocks;
+            ++k;
+        }
+
+        p->used_count -= blocks - 1;
+        free_block(p, run);
+        freed += blocks;
+    }
+
+    return freed;
+}
+
+// Gives back the end of the block i in use if there's enough of it beyond
+// sz bytes to be a block of its own.
+static void split_tail(
+        struct good_pool *p,
+        struct good_pool_item *i,
+        size_t sz) {
+    if (block_size(i) < sz + BLOCK_MIN_SIZE) return;
+
+    struct good_pool_item *tail = (void *)((char *)i + sz);
+    tail->prev_sz = 0;
+    tail->sz = (block_size(i) - sz) | (i->sz & BLOCK_LAST);
+    i->sz = sz;
+    ++p->used_count;
+    free_block(p, tail);
+}
+
+// Takes a block with room to spare and gives back the padding in front of
+// the aligned payload and whatever's left after it as free blocks.
+static struct good_pool_item *alloc_aligned_block(
+        struct good_pool *p,
+        size_t sz,
+        size_t align) {
+    struct good_pool_item *i = alloc_block(p, sz + align + BLOCK_MIN_SIZE);
+    if (!i) return NULL;
+
+    const uintptr_t payload = (uintptr_t)to_external_ptr(i);
+    size_t padding = (align - payload % align) % align;
+    // The padding has to be big enough to be a free block.
+    if (padding && padding < BLOCK_MIN_SIZE) padding += align;
+
+    if (padding) {
+        struct good_pool_item *lead = i;
+        i = (void *)((char *)lead + padding);
+        i->sz = (block_size(lead) - padding) | (lead->sz & BLOCK_LAST);
+        lead->sz = padding;
+        ++p->used_count;
+        free_block(p, lead);
+    }
+
+    split_tail(p, i, sz);
+    return i;
+}
+
+// Grows or shrinks the block i to sz bytes without moving it, if the block
+// after it is free and big enough.
+static bool resize_block(
+        struct good_pool *p,
+        struct good_pool_item *i,
+        size_t sz) {
+    if (block_size(i) < sz) {
+        if (block_is_last(i)) return false;
+
+        struct good_pool_item *next = next_block(i);
+        if (!block_is_free(next) || block_size(i) + block_size(next) < sz) {
+            return false;
+        }
+
+        pool_remove_free(p, next);
+        block_set_size(i, block_size(i) + block_size(next));
+        i->sz |= next->sz & BLOCK_LAST;
+        if (!block_is_last(i)) next_block(i)->prev_sz = 0;
+    }
+
+    split_tail(p, i, sz);
+    count_used(p, 0);
+    return true;
+}
+
+static void pool_lock(const struct good_pool *p) {
+    if (p->shared) pthread_mutex_lock((pthread_mutex_t *)&p->lock);
+}
+
+static void pool_unlock(const struct good_pool *p) {
+    if (p->shared) pthread_mutex_unlock((pthread_mutex_t *)&p->lock);
+}
+
+static struct good_pool_item **cache_next(struct good_pool_item *i) {
+    return to_external_ptr(i);
+}
+
+static void cache_push(struct good_pool_cache *c, struct good_pool_item *i) {
+    const size_t cls = block_size(i) / ALIGN_SIZE;
+    *cache_next(i) = c->blocks[cls];
+    c->blocks[cls] = i;
+    ++c->count[cls];
+}
+
+static struct good_pool_item *cache_pop(struct good_pool_cache *c, size_t cls) {
+    struct good_pool_item *i = c->blocks[cls];
+    if (i) {
+        c->blocks[cls] = *cache_next(i);
+        --c->count[cls];
+    }
+    return i;
+}
+
+// Must be called with the pool lock held.
+static void cache_drain(struct good_pool_cache *c, size_t cls, unsigned n) {
+    struct good_pool_item *i;
+    while (n-- && (i = cache_pop(c, cls))) {
+        free_block(c->pool, i);
+    }
+}
+
+// Must be called with the pool lock held.
+static void cache_drain_all(struct good_pool_cache *c) {
+    for (size_t cls = 0; cls < CACHE_CLASSES; ++cls) {
+        cache_drain(c, cls, c->count[cls]);
     }
+}
+
+static void flush_deferred(struct good_pool *p) {
+    cache_drain_all(&p->deferred);
+    p->deferred_count = 0;
+}
+
+static struct good_pool_item *deferred_alloc(
+        struct good_pool *p,
+        size_t sz) {
+    struct good_pool_item *i = sz <= CACHE_MAX_BLOCK_SIZE
+            ? cache_pop(&p->deferred, sz / ALIGN_SIZE)
+            : NULL;
+    if (i) {
+        --p->deferred_count;
+        return i;
+    }
+
+    return alloc_block(p, sz);
+}
+
+static void deferred_free(struct good_pool *p, struct good_pool_item *i) {
+    const size_t cls = block_size(i) / ALIGN_SIZE;
+    if (block_size(i) > CACHE_MAX_BLOCK_SIZE) {
+        free_block(p, i);
+        return;
+    }
+
+    cache_push(&p->deferred, i);
+    if (++p->deferred_count > p->deferred_budget) {
+        // Merging at most a batch of blocks at a time keeps the cost of any
+        // one free bounded.
+        const unsigned n = p->deferred.count[cls] < CACHE_BATCH
+                ? p->deferred.count[cls]
+                : CACHE_BATCH;
+        cache_drain(&p->deferred, cls, n);
+        p->deferred_count -= n;
+    }
+}
+
+// Runs when a thread that has used a shared pool exits.
+static void cache_destroy(void *arg) {
+    struct good_pool_cache *c = arg;
+    struct good_pool *p = c->pool;
+
+    pthread_mutex_lock(&p->lock);
+    cache_drain_all(c);
+    for (size_t n = 0; n < COUNT_KINDS; ++n) {
+        p->counts[n] += atomic_load_explicit(
+                &c->counts[n], memory_order_relaxed);
+    }
+    struct good_pool_cache **link = &p->caches;
+    while (*link != c) link = &(*link)->next;
+    *link = c->next;
+    pthread_mutex_unlock(&p->lock);
+
+    free(c);
+}
+
+static struct good_pool_cache *thread_cache(struct good_pool *p) {
+    struct good_pool_cache *c = pthread_getspecific(p->cache_key);
+    if (c) return c;
+
+    c = calloc(1, sizeof(*c));
+    if (!c) return NULL;
+
+    if (pthread_setspecific(p->cache_key, c)) {
+        free(c);
+        return NULL;
+    }
+
+    c->pool = p;
+    pthread_mutex_lock(&p->lock);
+    c->next = p->caches;
+    p->caches = c;
+    pthread_mutex_unlock(&p->lock);
+    return c;
+}
+
+// Counts in the thread's cache, or in the pool if the thread has no cache.
+static void shared_count(
+        struct good_pool *p,
+        struct good_pool_cache *c,
+        enum pool_count kind) {
+    if (c) {
+        // Only the cache's own thread writes its counts.
+        atomic_store_explicit(&c->counts[kind],
+                atomic_load_explicit(&c->counts[kind], memory_order_relaxed)
+                        + 1,
+                memory_order_relaxed);
+    } else {
+        pthread_mutex_lock(&p->lock);
+        ++p->counts[kind];
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+static struct good_pool_item *shared_alloc(
+        struct good_pool *p,
+        struct good_pool_cache *c,
+        size_t sz) {
+    if (sz > CACHE_MAX_BLOCK_SIZE) c = NULL;
+
+    struct good_pool_item *i = c ? cache_pop(c, sz / ALIGN_SIZE) : NULL;
+    if (i) return i;
 
-    for (struct good_pool_item *i = p->free; i->next != NULL; i = i->next) {
-        if ((uintptr_t)i + i->sz == (uintptr_t)i->next) {
-            i->sz += i->next->sz;
-            i->next = i->next->next;
-            if (i->next == NULL) return;
+    pthread_mutex_lock(&p->lock);
+    i = alloc_block(p, sz);
+    if (!i && c) {
+        // Our own cache may be holding on to what we need.
+        cache_drain_all(c);
+        i = alloc_block(p, sz);
+    }
+
+    if (i && c) {
+        struct good_pool_item *extra;
+        for (unsigned n = 1; n < CACHE_BATCH; ++n) {
+            if (!(extra = alloc_block(p, sz))) break;
+            if (block_size(extra) > CACHE_MAX_BLOCK_SIZE) {
+                free_block(p, extra);
+                break;
+            }
+            cache_push(c, extra);
         }
     }
+    pthread_mutex_unlock(&p->lock);
+
+    return i;
+}
+
+static void shared_free(
+        struct good_pool *p,
+        struct good_pool_cache *c,
+        struct good_pool_item *i) {
+    const size_t sz = block_size(i);
+    if (sz > CACHE_MAX_BLOCK_SIZE) c = NULL;
+
+    if (!c) {
+        pthread_mutex_lock(&p->lock);
+        free_block(p, i);
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+
+    // Blocks freed by a thread other than the one that allocated them end up
+    // in the freeing thread's cache and go back to the pool with its next
+    // batch.
+    cache_push(c, i);
+    if (c->count[sz / ALIGN_SIZE] > CACHE_LIMIT) {
+        pthread_mutex_lock(&p->lock);
+        cache_drain(c, sz / ALIGN_SIZE, CACHE_BATCH);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+static struct good_pool *pool_init(void *mem, size_t sz, bool owns_memory) {
+    struct good_pool *p = mem;
+    memset(p, 0, sizeof(*p));
+    p->sz = sz;
+    p->owns_memory = owns_memory;
+    p->total_sz = sz;
+    p->deferred.pool = p;
+
+    struct good_pool_item *i = first_block(p);
+    i->prev_sz = 0;
+    i->sz = sz | BLOCK_LAST;
+    pool_insert_free(p, i);
+    return p;
 }
 
-// TODO(robinlinden): Let the pool live in the one allocation? Probably.
 struct good_pool *pool_create(size_t sz) {
-    struct good_pool *p = malloc(sizeof(*p));
-    p->addr = malloc(sz);
-    p->used = NULL;
+    sz &= BLOCK_SIZE_MASK;
+    if (sz < BLOCK_MIN_SIZE || sz > POOL_MAX_SIZE) return NULL;
+
+    void *mem = malloc(ARENA_OFFSET + sz);
+    if (!mem) return NULL;
 
-    p->free = p->addr;
-    p->free->sz = sz;
-    p->free->next = NULL;
+    return pool_init(mem, sz, true);
+}
+
+struct good_pool *pool_create_in(void *buf, size_t sz) {
+    const size_t align = _Alignof(struct good_pool);
+    const size_t padding = (align - (uintptr_t)buf % align) % align;
+    if (sz < padding + ARENA_OFFSET) return NULL;
+
+    sz -= padding + ARENA_OFFSET;
+    if (sz > POOL_MAX_SIZE) sz = POOL_MAX_SIZE;
+    sz &= BLOCK_SIZE_MASK;
+    if (sz < BLOCK_MIN_SIZE) return NULL;
+
+    return pool_init((char *)buf + padding, sz, false);
+}
+
+struct good_pool *pool_create_on_node(size_t sz, int node) {
+    sz &= BLOCK_SIZE_MASK;
+    if (sz < BLOCK_MIN_SIZE || sz > POOL_MAX_SIZE) return NULL;
+
+    void *mem = numa_util_map(ARENA_OFFSET + sz, node);
+    if (!mem) return NULL;
+
+    struct good_pool *p = pool_init(mem, sz, true);
+    p->on_node = true;
+    p->node = node;
     return p;
 }
 
-void pool_destroy(struct good_pool *p) {
-    free(p->addr);
-    free(p);
+static struct good_pool *make_shared(struct good_pool *p) {
+    if (!p) return NULL;
+
+    if (pthread_key_create(&p->cache_key, cache_destroy)) {
+        pool_destroy(p);
+        return NULL;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    p->shared = true;
+    return p;
 }
 
-void *pool_alloc(struct good_pool *p, size_t sz) {
-    sz += (8 - sz % 8) % 8;
-    size_t actual_sz = sz + sizeof(struct good_pool_item);
-    struct good_pool_item *i = first_fit(p, actual_sz);
-    if (!i) return NULL;
+struct good_pool *pool_create_shared(size_t sz) {
+    return make_shared(pool_create(sz));
+}
+
+struct good_pool *pool_create_shared_on_node(size_t sz, int node) {
+    return make_shared(pool_create_on_node(sz, node));
+}
+
+void pool_set_growth(
+        struct good_pool *p,
+        enum pool_growth growth,
+        size_t chunk) {
+#ifdef GOOD_POOL_COMPACT_HEADERS
+    // Links can't reach memory outside of the pool, so it stays at
+    // POOL_GROW_NONE and never tries to grow.
+    (void)p;
+    (void)growth;
+    (void)chunk;
+#else
+    pool_lock(p);
+    p->growth = growth;
+    p->chunk = chunk;
+    pool_unlock(p);
+#endif
+}
+
+void pool_set_deferred_frees(struct good_pool *p, size_t budget) {
+    if (p->shared) return;
+
+    p->deferred_budget = budget;
+    flush_deferred(p);
+}
+
+void pool_trim(struct good_pool *p) {
+    pool_lock(p);
+    flush_deferred(p);
+    for (struct good_pool_arena **link = &p->arenas; *link;) {
+        struct good_pool_arena *a = *link;
+        struct good_pool_item *i = arena_first_block(a);
+        if (!block_is_free(i) || !block_is_last(i)) {
+            link = &a->next;
+            continue;
+        }
 
-    if (p->free->next) {
         pool_remove_free(p, i);
+        *link = a->next;
+        p->total_sz -= a->sz;
+        arena_free(p, a);
+    }
+    pool_unlock(p);
+}
+
+void pool_destroy(struct good_pool *p) {
+    if (p->shared) {
+        // Deleting the key doesn't wait for cache_destroy calls that are
+        // already running, see pool_create_shared.
+        pthread_key_delete(p->cache_key);
+        while (p->caches) {
+            struct good_pool_cache *c = p->caches;
+            p->caches = c->next;
+            free(c);
+        }
+        pthread_mutex_destroy(&p->lock);
+    }
+
+    while (p->arenas) {
+        struct good_pool_arena *a = p->arenas;
+        p->arenas = a->next;
+        arena_free(p, a);
+    }
+
+    if (p->on_node) {
+        munmap(p, ARENA_OFFSET + p->sz);
+    } else if (p->owns_memory) {
+        free(p);
+    }
+}
+
+// pool_alloc and pool_free without their tracing. Only the public calls
+// trace, so one that's built on another still records its own caller.
+static void *alloc_ptr(struct good_pool *p, size_t sz) {
+    struct good_pool_item *i = NULL;
+
+    if (p->shared) {
+        struct good_pool_cache *c = thread_cache(p);
+        if (sz <= SIZE_MAX / 2) i = shared_alloc(p, c, to_block_size(sz));
+        shared_count(p, c, i ? COUNT_ALLOCS : COUNT_FAILURES);
     } else {
-        p->free = NULL;
+        if (sz <= SIZE_MAX / 2) {
+            i = p->deferred_budget
+                    ? deferred_alloc(p, to_block_size(sz))
+                    : alloc_block(p, to_block_size(sz));
+        }
+        ++p->counts[i ? COUNT_ALLOCS : COUNT_FAILURES];
     }
 
-    if (i->sz >= actual_sz + sizeof(struct good_pool_item)) {
-        struct good_pool_item *remainder = (void *)((char *)i + actual_sz);
-        remainder->sz = i->sz - actual_sz;
-        i->sz = actual_sz;
-        remainder->next = p->free;
-        p->free = remainder;
+    return i ? to_external_ptr(i) : NULL;
+}
+
+static void free_ptr(struct good_pool *p, void *ptr) {
+    if (p->shared) {
+        struct good_pool_cache *c = thread_cache(p);
+        shared_free(p, c, to_pool_ptr(ptr));
+        shared_count(p, c, COUNT_FREES);
+    } else if (p->deferred_budget) {
+        deferred_free(p, to_pool_ptr(ptr));
+        ++p->counts[COUNT_FREES];
+    } else {
+        free_block(p, to_pool_ptr(ptr));
+        ++p->counts[COUNT_FREES];
     }
+}
 
-    i->next = p->used;
-    p->used = i;
+static void *alloc_aligned_ptr(struct good_pool *p, size_t sz, size_t align) {
+    if (align <= ALIGN_SIZE) return alloc_ptr(p, sz);
 
-    return to_external_ptr(i);
+    struct good_pool_item *i = NULL;
+
+    pool_lock(p);
+    if (sz <= SIZE_MAX / 4 && align <= SIZE_MAX / 4) {
+        i = alloc_aligned_block(p, to_block_size(sz), align);
+    }
+    ++p->counts[i ? COUNT_ALLOCS : COUNT_FAILURES];
+    pool_unlock(p);
+
+    return i ? to_external_ptr(i) : NULL;
+}
+
+void *pool_alloc(struct good_pool *p, size_t sz) {
+    void *ptr = alloc_ptr(p, sz);
+    TRACE_ALLOC(p, ptr, sz);
+    return ptr;
+}
+
+void *pool_alloc_aligned(struct good_pool *p, size_t sz, size_t align) {
+    if (!align || align & (align - 1)) return NULL;
+
+    void *ptr = alloc_aligned_ptr(p, sz, align);
+    TRACE_ALLOC(p, ptr, sz);
+    return ptr;
+}
+
+void *pool_realloc(struct good_pool *p, void *ptr, size_t sz) {
+    if (!ptr) {
+        void *allocated = alloc_ptr(p, sz);
+        TRACE_ALLOC(p, allocated, sz);
+        return allocated;
+    }
+    if (!sz) {
+        TRACE_FREE(p, ptr);
+        free_ptr(p, ptr);
+        return NULL;
+    }
+
+    struct good_pool_item *i = to_pool_ptr(ptr);
+    const size_t old_sz = block_size(i);
+    if (sz <= SIZE_MAX / 2) {
+        pool_lock(p);
+        const bool resized = resize_block(p, i, to_block_size(sz));
+        pool_unlock(p);
+        if (resized) {
+            TRACE_FREE(p, ptr);
+            TRACE_ALLOC(p, ptr, sz);
+            return ptr;
+        }
+    }
+
+    void *moved = alloc_ptr(p, sz);
+    if (!moved) return NULL;
+
+    memcpy(moved, ptr, old_sz - BLOCK_HEADER_SIZE);
+    TRACE_ALLOC(p, moved, sz);
+    TRACE_FREE(p, ptr);
+    free_ptr(p, ptr);
+    return moved;
 }
 
 void pool_free(struct good_pool *p, void* ptr) {
     if (!ptr) return;
+    TRACE_FREE(p, ptr);
+    free_ptr(p, ptr);
+}
 
-    struct good_pool_item *i = list_find(p->used, to_pool_ptr(ptr));
-    pool_remove_used(p, i);
+// Starts a new scratch chunk that fits at least sz bytes.
+static void *region_grow(struct good_pool *p, size_t sz) {
+    if (sz > SIZE_MAX / 2 - REGION_HEADER_SIZE) return NULL;
 
-    i->next = p->free;
-    p->free = i;
+    sz = (sz + ALIGN_SIZE - 1) & BLOCK_SIZE_MASK;
+    const size_t chunk = sz + REGION_HEADER_SIZE;
+    pool_lock(p);
+    struct good_pool_item *i = chunk < REGION_CHUNK_SIZE
+            ? alloc_block(p, to_block_size(REGION_CHUNK_SIZE))
+            : NULL;
+    if (!i) i = alloc_block(p, to_block_size(chunk));
+    pool_unlock(p);
+    if (!i) return NULL;
 
-    pool_coalesce(p);
+    struct good_pool_region *r = to_external_ptr(i);
+    r->prev = p->region;
+    r->end = (char *)i + block_size(i);
+    p->region = r;
+    p->region_top = (char *)r + REGION_HEADER_SIZE + sz;
+    p->region_end = r->end;
+    return (char *)r + REGION_HEADER_SIZE;
 }
 
-size_t pool_available(const struct good_pool *p) {
-    size_t available = 0;
+void *pool_alloc_scratch(struct good_pool *p, size_t sz) {
+    if (!sz) sz = 1;
+    // What's left of the chunk is a multiple of ALIGN_SIZE, so sz still fits
+    // once it's rounded up.
+    if (sz > (size_t)(p->region_end - p->region_top)) {
+        return region_grow(p, sz);
+    }
 
-    for (struct good_pool_item *i = p->free; i != NULL; i = i->next) {
-        available += i->sz;
+    void *ptr = p->region_top;
+    p->region_top += (sz + ALIGN_SIZE - 1) & BLOCK_SIZE_MASK;
+    return ptr;
+}
+
+struct pool_region_mark pool_mark(const struct good_pool *p) {
+    return (struct pool_region_mark){p->region, p->region_top};
+}
+
+void pool_release_to(struct good_pool *p, struct pool_region_mark mark) {
+    if (p->region != mark.chunk) {
+        pool_lock(p);
+        while (p->region != mark.chunk) {
+            struct good_pool_region *r = p->region;
+            p->region = r->prev;
+            free_block(p, to_pool_ptr(r));
+        }
+        pool_unlock(p);
     }
 
-    return available;
+    p->region_top = mark.top;
+    p->region_end = p->region ? p->region->end : NULL;
 }
 
-size_t pool_allocated(const struct good_pool *p) {
-    size_t allocated = 0;
+void pool_reset(struct good_pool *p) {
+    pool_release_to(p, (struct pool_region_mark){NULL, NULL});
+}
+
+size_t pool_alloc_batch(
+        struct good_pool *p,
+        size_t sz,
+        size_t n,
+        void **out) {
+    size_t count = 0;
 
-    for (struct good_pool_item *i = p->used; i != NULL; i = i->next) {
-        allocated += i->sz;
+    pool_lock(p);
+    if (sz <= SIZE_MAX / 2) count = alloc_blocks(p, to_block_size(sz), n, out);
+    p->counts[COUNT_ALLOCS] += count;
+    p->counts[COUNT_FAILURES] += n - count;
+    pool_unlock(p);
+
+#ifdef POOL_TRACING
+    for (size_t k = 0; k < count; ++k) TRACE_ALLOC(p, out[k], sz);
+#endif
+    return count;
+}
+
+void pool_free_batch(struct good_pool *p, void **ptrs, size_t n) {
+#ifdef POOL_TRACING
+    for (size_t k = 0; k < n; ++k) TRACE_FREE(p, ptrs[k]);
+#endif
+    pool_lock(p);
+    p->counts[COUNT_FREES] += free_blocks(p, ptrs, n);
+    pool_unlock(p);
+}
+
+int pool_owns(const struct good_pool *p, const void *ptr) {
+    const char *start = (char *)first_block(p);
+    if ((const char *)ptr >= start && (const char *)ptr < start + p->sz) {
+        return 1;
     }
 
+    int owns = 0;
+    pool_lock(p);
+    for (const struct good_pool_arena *a = p->arenas; a && !owns;
+            a = a->next) {
+        start = (char *)arena_first_block(a);
+        owns = (const char *)ptr >= start && (const char *)ptr < start + a->sz;
+    }
+    pool_unlock(p);
+    return owns;
+}
+
+size_t pool_available(const struct good_pool *p) {
+    pool_lock(p);
+    const size_t available = p->free_sz;
+    pool_unlock(p);
+
+    return available;
+}
+
+size_t pool_allocated(const struct good_pool *p) {
+    pool_lock(p);
+    const size_t allocated = p->total_sz - p->free_sz;
+    pool_unlock(p);
+
     return allocated;
 }
 
 size_t pool_free_blocks(const struct good_pool *p) {
-    size_t blocks = 0;
-
-    for (struct good_pool_item *i = p->free; i != NULL; i = i->next) {
-        ++blocks;
-    }
+    pool_lock(p);
+    const size_t blocks = p->free_count;
+    pool_unlock(p);
 
     return blocks;
 }
 
 size_t pool_used_blocks(const struct good_pool *p) {
-    size_t blocks = 0;
+    pool_lock(p);
+    const size_t blocks = p->used_count;
+    pool_unlock(p);
+
+    return blocks;
+}
+
+// Only the largest non-empty bin has to be searched.
+static size_t largest_free_block(const struct good_pool *p) {
+    if (!p->fl_bitmap) return 0;
 
-    for (struct good_pool_item *i = p->used; i != NULL; i = i->next) {
-        ++blocks;
+    const unsigned fl = find_last_set(p->fl_bitmap);
+    const unsigned sl = find_last_set(p->sl_bitmap[fl]);
+    size_t largest = 0;
+    for (const struct good_pool_item *i = p->free[fl][sl];
+            i != NULL;
+            i = from_link(p, i->next_free)) {
+        if (block_size(i) > largest) largest = block_size(i);
     }
 
-    return blocks;
+    return largest;
+}
+
+void pool_get_stats(const struct good_pool *p, struct pool_stats *stats) {
+    size_t counts[COUNT_KINDS];
+
+    pool_lock(p);
+    memcpy(counts, p->counts, sizeof(counts));
+    for (const struct good_pool_cache *c = p->caches; c; c = c->next) {
+        for (size_t n = 0; n < COUNT_KINDS; ++n) {
+            counts[n] += atomic_load_explicit(
+                    &c->counts[n], memory_order_relaxed);
+        }
+    }
+
+    stats->available = p->free_sz;
+    stats->allocated = p->total_sz - p->free_sz;
+    stats->free_blocks = p->free_count;
+    stats->used_blocks = p->used_count;
+    stats->peak_allocated = p->peak_allocated;
+    stats->largest_free_block = largest_free_block(p);
+    pool_unlock(p);
+
+    stats->allocs = counts[COUNT_ALLOCS];
+    stats->frees = counts[COUNT_FREES];
+    stats->failures = counts[COUNT_FAILURES];
+}
+
+void pool_walk(const struct good_pool *p, pool_walk_fn visit, void *arg) {
+    pool_lock(p);
+    const struct good_pool_arena *next_arena = p->arenas;
+    const struct good_pool_item *arena_start = first_block(p);
+    unsigned arena = 0;
+
+    for (const struct good_pool_item *i = arena_start; i;) {
+        const struct pool_block block = {
+            .arena = arena,
+            .offset = (char *)i - (char *)arena_start,
+            .sz = block_size(i),
+            .in_use = !block_is_free(i),
+        };
+        visit(arg, &block);
+
+        if (!block_is_last(i)) {
+            i = next_block(i);
+        } else if (next_arena) {
+            i = arena_start = arena_first_block(next_arena);
+            next_arena = next_arena->next;
+            ++arena;
+        } else {
+            i = NULL;
+        }
+    }
+    pool_unlock(p);
+}
+
+static void count_fragment(void *arg, const struct pool_block *block) {
+    struct pool_fragmentation *f = arg;
+    if (block->in_use) return;
+
+    f->free_bytes += block->sz;
+    ++f->free_blocks;
+    if (block->sz > f->largest_free_block) f->largest_free_block = block->sz;
+    ++f->histogram[find_last_set(block->sz)];
+}
+
+void pool_get_fragmentation(
+        const struct good_pool *p,
+        struct pool_fragmentation *f) {
+    memset(f, 0, sizeof(*f));
+    pool_walk(p, count_fragment, f);
+    if (f->free_bytes) {
+        f->fragmentation =
+                1.0 - (double)f->largest_free_block / f->free_bytes;
+    }
 }
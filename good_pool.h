@@ -7,19 +7,156 @@
 extern "C" {
 #endif
 
+// Built with GOOD_POOL_COMPACT_HEADERS, blocks have 8-byte headers instead
+// of 16. Pools then have to be smaller than 4 GiB and never grow.
 struct good_pool;
 
+// What a pool does when it runs out of memory.
+enum pool_growth {
+    // Fail the allocation.
+    POOL_GROW_NONE,
+    // Add an arena as big as all of the pool's arenas together.
+    POOL_GROW_DOUBLE,
+    // Add an arena of a fixed size.
+    POOL_GROW_FIXED,
+};
+
 struct good_pool *pool_create(size_t sz);
+// Creates a pool inside of buf without allocating anything. The pool's
+// bookkeeping takes up the first few KiB of buf and destroying the pool
+// leaves freeing buf to the caller.
+struct good_pool *pool_create_in(void *buf, size_t sz);
+// Creates a pool that can be used from several threads at once. Every thread
+// keeps a small cache of blocks, and blocks sitting in a cache count as
+// allocated. The caches are found through a pthread key of the pool's own,
+// so a process can only have as many shared pools at once as it has keys to
+// spare, PTHREAD_KEYS_MAX (1024 with glibc) minus the keys used elsewhere.
+// Creating one more returns NULL.
+//
+// Threads hand their caches back to the pool as they exit, so a shared pool
+// may only be destroyed once every thread that used it has either been
+// joined or is sure to outlive pool_destroy. A thread that's exiting while
+// the pool is destroyed can touch freed memory.
+struct good_pool *pool_create_shared(size_t sz);
+// Like pool_create and pool_create_shared, but the pool's memory and any
+// arenas it grows come from the NUMA node given. See numa_util.h.
+struct good_pool *pool_create_on_node(size_t sz, int node);
+struct good_pool *pool_create_shared_on_node(size_t sz, int node);
 void pool_destroy(struct good_pool *pool);
 
+// chunk is the size of new arenas for POOL_GROW_FIXED. An arena is never
+// smaller than the allocation that triggered it.
+void pool_set_growth(
+        struct good_pool *pool,
+        enum pool_growth growth,
+        size_t chunk);
+// Lets up to budget small freed blocks wait to be merged with their
+// neighbours. Until then they're handed straight back to allocations of the
+// same size, and they count as allocated. They're merged as the budget runs
+// out, when an allocation would fail otherwise and on pool_trim. A budget of
+// 0, the default, merges every block as it's freed. Shared pools already
+// keep freed blocks in their thread caches and ignore this.
+void pool_set_deferred_frees(struct good_pool *pool, size_t budget);
+// Gives arenas the pool added to grow back to the system once they're empty
+// and merges any deferred frees.
+void pool_trim(struct good_pool *pool);
+
 void *pool_alloc(struct good_pool *pool, size_t sz);
+// align has to be a power of two. The padding in front of the block goes
+// back to the pool as a free block.
+void *pool_alloc_aligned(struct good_pool *pool, size_t sz, size_t align);
+// Grows or shrinks the block in place when the block after it has room, and
+// only moves it otherwise. A NULL ptr allocates and a sz of 0 frees.
+void *pool_realloc(struct good_pool *pool, void *ptr, size_t sz);
 void pool_free(struct good_pool *pool, void *ptr);
 
+// Allocates n blocks of sz bytes at once and returns how many it could get.
+// The blocks are carved out of as few free blocks as possible, and on a
+// shared pool the lock is only taken once.
+size_t pool_alloc_batch(
+        struct good_pool *pool,
+        size_t sz,
+        size_t n,
+        void **out);
+// Frees n blocks at once. Blocks that follow each other in memory, like the
+// ones pool_alloc_batch hands out, are coalesced in one go when they're next
+// to each other in ptrs too.
+void pool_free_batch(struct good_pool *pool, void **ptrs, size_t n);
+
+// Scratch allocations are bumped out of chunks of the pool and can't be
+// freed one by one. Instead everything allocated after a mark is thrown
+// away at once by releasing the mark, and pool_reset throws away all of it.
+// The chunks count as used blocks until they're released. A pool has one
+// scratch region, so only one thread at a time may use it, even if the pool
+// is shared.
+struct pool_region_mark {
+    void *chunk;
+    void *top;
+};
+
+void *pool_alloc_scratch(struct good_pool *pool, size_t sz);
+struct pool_region_mark pool_mark(const struct good_pool *pool);
+void pool_release_to(struct good_pool *pool, struct pool_region_mark mark);
+void pool_reset(struct good_pool *pool);
+
+// Returns 1 if ptr points into one of the pool's arenas, 0 otherwise.
+int pool_owns(const struct good_pool *pool, const void *ptr);
+
 size_t pool_available(const struct good_pool *pool);
 size_t pool_allocated(const struct good_pool *pool);
 size_t pool_free_blocks(const struct good_pool *pool);
 size_t pool_used_blocks(const struct good_pool *pool);
 
+struct pool_stats {
+    size_t available;
+    size_t allocated;
+    size_t free_blocks;
+    size_t used_blocks;
+    // The most memory that has been allocated at once.
+    size_t peak_allocated;
+    size_t largest_free_block;
+    size_t allocs;
+    size_t frees;
+    // Allocations that returned NULL.
+    size_t failures;
+};
+
+void pool_get_stats(const struct good_pool *pool, struct pool_stats *stats);
+
+struct pool_block {
+    // Arenas are numbered in the order they're walked, the pool's own first.
+    unsigned arena;
+    // From the start of the arena.
+    size_t offset;
+    size_t sz;
+    // Blocks in thread caches and deferred frees count as in use.
+    int in_use;
+};
+
+typedef void (*pool_walk_fn)(void *arg, const struct pool_block *block);
+
+// Calls visit for every block of every arena in address order. Shared pools
+// are locked throughout, so visit must not use the pool.
+void pool_walk(const struct good_pool *pool, pool_walk_fn visit, void *arg);
+
+#define POOL_HISTOGRAM_BUCKETS 64
+
+struct pool_fragmentation {
+    size_t free_bytes;
+    size_t free_blocks;
+    size_t largest_free_block;
+    // 1 - largest_free_block / free_bytes. 0 means all free memory is in one
+    // block, and it gets closer to 1 the more it's split up.
+    double fragmentation;
+    // histogram[n] counts the free blocks of at least 2^n bytes and less
+    // than 2^(n + 1).
+    size_t histogram[POOL_HISTOGRAM_BUCKETS];
+};
+
+void pool_get_fragmentation(
+        const struct good_pool *pool,
+        struct pool_fragmentation *fragmentation);
+
 #ifdef __cplusplus
 }
 #endif
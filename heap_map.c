@@ -0,0 +1,169 @@
+// Prints the layout of a pool from a snapshot written by pool_snapshot.h.
+//
+//   heap_map [-w cells per row] [-c bytes per cell] [snapshot]
+//
+// Every arena is drawn as rows of cells, '#' for memory in use, '.' for free
+// memory and '+' for cells with both. A summary of the free memory follows.
+// The snapshot is read from stdin if no file is given.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h> // getopt
+
+#define HISTOGRAM_BUCKETS 64
+#define MAX_ROWS_PER_ARENA 32
+
+struct block {
+    unsigned arena;
+    size_t offset;
+    size_t size;
+    int in_use;
+};
+
+struct snapshot {
+    struct block *blocks;
+    size_t count;
+    size_t capacity;
+};
+
+static int read_snapshot(FILE *f, struct snapshot *s) {
+    struct block b;
+    while (fscanf(f, "%u %zu %zu %d", &b.arena, &b.offset, &b.size,
+            &b.in_use) == 4) {
+        if (s->count == s->capacity) {
+            const size_t capacity = s->capacity ? s->capacity * 2 : 1024;
+            struct block *blocks =
+                    realloc(s->blocks, capacity * sizeof(*blocks));
+            if (!blocks) return -1;
+            s->blocks = blocks;
+            s->capacity = capacity;
+        }
+        s->blocks[s->count++] = b;
+    }
+
+    return ferror(f) || !feof(f) ? -1 : 0;
+}
+
+static void print_arena(
+        const struct block *blocks,
+        size_t count,
+        size_t width,
+        size_t cell) {
+    const struct block *last = &blocks[count - 1];
+    const size_t arena_size = last->offset + last->size;
+    if (!cell) {
+        cell = (arena_size + width * MAX_ROWS_PER_ARENA - 1)
+                / (width * MAX_ROWS_PER_ARENA);
+        if (!cell) cell = 1;
+    }
+
+    const size_t cells = (arena_size + cell - 1) / cell;
+    // Bit 0 is set for cells with memory in use and bit 1 for free memory.
+    unsigned char *map = calloc(cells, 1);
+    if (!map) return;
+
+    for (size_t n = 0; n < count; ++n) {
+        const size_t end = blocks[n].offset + blocks[n].size;
+        for (size_t c = blocks[n].offset / cell; c * cell < end; ++c) {
+            map[c] |= blocks[n].in_use ? 1 : 2;
+        }
+    }
+
+    printf("arena %u: %zu bytes in %zu blocks, %zu bytes per cell\n",
+            blocks[0].arena, arena_size, count, cell);
+    for (size_t c = 0; c < cells; ++c) {
+        putchar(map[c] == 1 ? '#' : map[c] == 2 ? '.' : '+');
+        if ((c + 1) % width == 0 || c + 1 == cells) putchar('\n');
+    }
+    putchar('\n');
+
+    free(map);
+}
+
+static void print_summary(const struct snapshot *s) {
+    size_t used = 0, free_bytes = 0, free_blocks = 0, largest = 0;
+    size_t histogram[HISTOGRAM_BUCKETS] = {0};
+
+    for (size_t n = 0; n < s->count; ++n) {
+        const struct block *b = &s->blocks[n];
+        if (b->in_use) {
+            used += b->size;
+            continue;
+        }
+
+        free_bytes += b->size;
+        ++free_blocks;
+        if (b->size > largest) largest = b->size;
+        if (b->size) ++histogram[63 - __builtin_clzll(b->size)];
+    }
+
+    printf("in use: %zu bytes in %zu blocks\n", used, s->count - free_blocks);
+    printf("free: %zu bytes in %zu blocks\n", free_bytes, free_blocks);
+    printf("largest free block: %zu bytes\n", largest);
+    printf("fragmentation: %.1f%%\n", free_bytes
+            ? 100.0 * (1.0 - (double)largest / free_bytes)
+            : 0.0);
+
+    printf("free blocks by size:\n");
+    for (size_t n = 0; n < HISTOGRAM_BUCKETS; ++n) {
+        if (histogram[n]) {
+            printf("  %20zu+ %zu\n", (size_t)1 << n, histogram[n]);
+        }
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-w cells per row] [-c bytes per cell] "
+            "[snapshot]\n", name);
+}
+
+int main(int argc, char **argv) {
+    size_t width = 64;
+    size_t cell = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:c:")) != -1) {
+        switch (opt) {
+        case 'w':
+            width = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            cell = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!width || optind + 1 < argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    FILE *f = optind < argc ? fopen(argv[optind], "r") : stdin;
+    if (!f) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    struct snapshot s = {0};
+    const int error = read_snapshot(f, &s);
+    if (f != stdin) fclose(f);
+    if (error) {
+        fprintf(stderr, "%s: couldn't read the snapshot\n", argv[0]);
+        free(s.blocks);
+        return 1;
+    }
+
+    // Blocks are written arena by arena.
+    for (size_t start = 0, end; start < s.count; start = end) {
+        for (end = start; end < s.count
+                && s.blocks[end].arena == s.blocks[start].arena; ++end) {
+        }
+        print_arena(&s.blocks[start], end - start, width, cell);
+    }
+    print_summary(&s);
+
+    free(s.blocks);
+    return 0;
+}
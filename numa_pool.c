@@ -0,0 +1,82 @@
+#include "numa_pool.h"
+#include "numa_util.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+struct numa_pool {
+    int nodes;
+    struct good_pool *pools[];
+};
+
+struct numa_pool *numa_pool_create(size_t sz) {
+    const int nodes = numa_util_nodes();
+    struct numa_pool *set =
+            malloc(sizeof(*set) + nodes * sizeof(set->pools[0]));
+    if (!set) return NULL;
+
+    for (set->nodes = 0; set->nodes < nodes; ++set->nodes) {
+        struct good_pool *p = pool_create_shared_on_node(sz, set->nodes);
+        // Nodes listed as possible can be offline or have no memory, and
+        // mbind can be refused altogether, by seccomp or a cpuset.
+        if (!p) p = pool_create_shared(sz);
+        if (!p) {
+            numa_pool_destroy(set);
+            return NULL;
+        }
+        set->pools[set->nodes] = p;
+    }
+
+    return set;
+}
+
+void numa_pool_destroy(struct numa_pool *set) {
+    for (int node = 0; node < set->nodes; ++node) {
+        pool_destroy(set->pools[node]);
+    }
+    free(set);
+}
+
+void *numa_pool_alloc(struct numa_pool *set, size_t sz) {
+    const int local = set->nodes > 1 ? numa_util_current_node() : 0;
+    void *ptr = pool_alloc(set->pools[local], sz);
+
+    for (int node = 0; !ptr && node < set->nodes; ++node) {
+        if (node != local) ptr = pool_alloc(set->pools[node], sz);
+    }
+    return ptr;
+}
+
+void numa_pool_free(struct numa_pool *set, void *ptr) {
+    if (!ptr) return;
+    if (set->nodes == 1) {
+        pool_free(set->pools[0], ptr);
+        return;
+    }
+
+    // Blocks are usually freed on the node that allocated them.
+    const int local = numa_util_current_node();
+    if (pool_owns(set->pools[local], ptr)) {
+        pool_free(set->pools[local], ptr);
+        return;
+    }
+
+    for (int node = 0; node < set->nodes; ++node) {
+        if (node != local && pool_owns(set->pools[node], ptr)) {
+            pool_free(set->pools[node], ptr);
+            return;
+        }
+    }
+
+    // A bad free. It would crash or corrupt any other pool, here it would
+    // just go unnoticed.
+    assert(!"numa_pool_free: ptr isn't from this set");
+}
+
+int numa_pool_nodes(const struct numa_pool *set) {
+    return set->nodes;
+}
+
+struct good_pool *numa_pool_node(struct numa_pool *set, int node) {
+    return node >= 0 && node < set->nodes ? set->pools[node] : NULL;
+}
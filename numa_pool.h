@@ -0,0 +1,37 @@
+#ifndef NUMA_POOL_H_
+#define NUMA_POOL_H_
+
+#include <stddef.h> // size_t
+
+#include "good_pool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A shared pool per NUMA node. Allocations come from the pool of the node
+// the calling thread is running on, and only from other nodes once that one
+// is full. Frees go back to whichever pool the block came from, so blocks
+// can be freed from any thread. On a machine with a single node a set is a
+// shared pool with an extra branch.
+struct numa_pool;
+
+// Every node gets a pool of sz bytes. Each of them is a shared pool and
+// takes up a pthread key, see pool_create_shared.
+struct numa_pool *numa_pool_create(size_t sz);
+void numa_pool_destroy(struct numa_pool *set);
+
+void *numa_pool_alloc(struct numa_pool *set, size_t sz);
+// On machines with more than one node, freeing a pointer that none of the
+// set's pools own fails an assert. With NDEBUG the free is ignored.
+void numa_pool_free(struct numa_pool *set, void *ptr);
+
+int numa_pool_nodes(const struct numa_pool *set);
+// The pool of a node, to set its growth or read its stats.
+struct good_pool *numa_pool_node(struct numa_pool *set, int node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
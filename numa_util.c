@@ -0,0 +1,82 @@
+#define _GNU_SOURCE // getcpu
+
+#include "numa_util.h"
+
+#include <errno.h>
+#include <limits.h> // CHAR_BIT
+#include <linux/mempolicy.h> // MPOL_BIND
+#include <sched.h> // getcpu
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/mman.h> // mmap, munmap
+#include <sys/syscall.h> // SYS_mbind
+#include <unistd.h> // syscall
+
+// Node masks passed to mbind cover this many nodes.
+#define MAX_NODES 1024
+#define MASK_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+// Counts the nodes in /sys/devices/system/node/possible, which lists node
+// ranges like "0-1,3". Falls back to one node if it can't be read.
+static int count_nodes(void) {
+    FILE *f = fopen("/sys/devices/system/node/possible", "r");
+    if (!f) return 1;
+
+    int nodes = 1;
+    int first, last;
+    for (;;) {
+        if (fscanf(f, "%d", &first) != 1) break;
+        last = first;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%d", &last) != 1) break;
+            c = fgetc(f);
+        }
+        if (last + 1 > nodes) nodes = last + 1;
+        if (c != ',') break;
+    }
+    fclose(f);
+
+    return nodes < MAX_NODES ? nodes : MAX_NODES;
+}
+
+int numa_util_nodes(void) {
+    static atomic_int nodes;
+    int n = atomic_load_explicit(&nodes, memory_order_relaxed);
+    if (!n) {
+        n = count_nodes();
+        atomic_store_explicit(&nodes, n, memory_order_relaxed);
+    }
+    return n;
+}
+
+int numa_util_current_node(void) {
+    unsigned cpu, node;
+    if (getcpu(&cpu, &node)) return 0;
+    return (int)node < numa_util_nodes() ? (int)node : 0;
+}
+
+int numa_util_bind(void *mem, size_t size, int node) {
+    if (node < 0 || node >= numa_util_nodes()) return -1;
+
+    unsigned long mask[MAX_NODES / MASK_BITS] = {0};
+    mask[node / MASK_BITS] = 1ul << node % MASK_BITS;
+    if (syscall(SYS_mbind, mem, size, MPOL_BIND, mask, MAX_NODES, 0)) {
+        // Kernels built without NUMA have nothing to bind, all memory is on
+        // node 0 anyway.
+        return errno == ENOSYS && node == 0 ? 0 : -1;
+    }
+    return 0;
+}
+
+void *numa_util_map(size_t size, int node) {
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+
+    if (numa_util_bind(mem, size, node)) {
+        munmap(mem, size);
+        return NULL;
+    }
+    return mem;
+}
@@ -0,0 +1,29 @@
+#ifndef NUMA_UTIL_H_
+#define NUMA_UTIL_H_
+
+#include <stddef.h> // size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// NUMA nodes are numbered from 0. Machines and kernels without NUMA have a
+// single node, 0, and binding memory to it always works.
+
+int numa_util_nodes(void);
+// The node of the CPU the calling thread is running on.
+int numa_util_current_node(void);
+
+// Makes the pages of [mem, mem + size) come from node when they're first
+// touched. mem has to be page aligned. Returns 0, or -1 if node doesn't
+// exist or the kernel refuses.
+int numa_util_bind(void *mem, size_t size, int node);
+// Maps size bytes of anonymous memory bound to node. Returns NULL on
+// failure. The memory is given back with munmap.
+void *numa_util_map(size_t size, int node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,33 +1,79 @@
 #include "pool2.h"
+#include "pool2_format.h"
+#include "numa_util.h"
+#include "pool_trace_hooks.h"
 
+#include <errno.h> // EOWNERDEAD
+#include <pthread.h>
 #include <stdbool.h> // true, false
+#include <stdint.h> // uint32_t, uint64_t, uintptr_t, UINT32_MAX
 #include <stdlib.h> // malloc, free, NULL
+#include <string.h> // memcpy, memset
+#include <sys/file.h> // flock
+#include <sys/mman.h> // mmap, mprotect, madvise, munmap
+#include <fcntl.h> // open
+#include <sys/stat.h> // fstat
+#include <unistd.h> // close, ftruncate, read, sysconf
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Marks memory that holds a pool, so a pool that's attached to or read back
+// from a file can be told apart from garbage. The version changes with the
+// layout of struct pool2.
+#define POOL2_MAGIC 0x706f6f6c32000004ull // "pool2", version 4
+
+// A boot id is a UUID, 36 characters.
+#define BOOT_ID_SIZE 37
 
 struct pool2 {
-    unsigned size;
-};
+    uint64_t magic;
+    size_t size; // bytes reserved for blocks
+    size_t committed; // bytes at the start of the arena covered by blocks
+    size_t commit_step;
+    uint32_t free; // first free block, 0 if there are none
+    size_t free_blocks; // in this arena
+    bool mapped;
+    int node; // the NUMA node the arena is bound to, -1 if it isn't
 
-typedef struct pool2_item_header {
-    unsigned size : 30;
-    unsigned in_use : 1;
-    unsigned first : 1; // no blocks before this
-} pool2_item_header;
+    // Pools that are allowed to grow chain extra pools after themselves.
+    enum pool2_growth growth;
+    size_t chunk;
+    size_t total_size; // of the whole chain
+    struct pool2 *next_arena;
 
-typedef struct pool2_item_footer {
-    unsigned size : 30;
-    unsigned last : 1; // no blocks after this
-    unsigned : 1; // spare byte if one of the others break
-} pool2_item_footer;
+    // Only kept up to date in the first arena, for the whole chain.
+    size_t allocated;
+    size_t used_blocks;
+    size_t peak_allocated;
+    size_t allocs;
+    size_t frees;
+    size_t failures;
+
+    // Shared pools sit in memory mapped by several processes. Nothing in
+    // them may point into the mapping, and they never grow.
+    bool shared;
+    pthread_mutex_t lock;
+    // The boot the lock was set up in, empty if that isn't known.
+    char lock_boot[BOOT_ID_SIZE];
+    pool2_handle root;
+};
 
 #define ALLOCATION_OVERHEAD \
-    sizeof(pool2_item_header) + sizeof(pool2_item_footer)
+    (sizeof(pool2_item_header) + sizeof(pool2_item_footer))
+
+#define MIN_BLOCK_SIZE (ALLOCATION_OVERHEAD + sizeof(pool2_free_links))
+
+#define FIRST_BLOCK_OFFSET ((sizeof(struct pool2) + 7) / 8 * 8)
+
+// The furthest the free list links can reach.
+#define MAX_POOL_SIZE ((size_t)UINT32_MAX * 8 - FIRST_BLOCK_OFFSET)
 
 static pool2_item_footer *footer(const pool2_item_header *i) {
     return (void *)((char *)i + i->size - sizeof(pool2_item_footer));
 }
 
 static pool2_item_header *first_block(const struct pool2 *pool) {
-    return (pool2_item_header *)(pool + 1);
+    return (void *)((char *)pool + FIRST_BLOCK_OFFSET);
 }
 
 static pool2_item_header *next_block(const pool2_item_header *block) {
@@ -35,59 +81,663 @@ static pool2_item_header *next_block(const pool2_item_header *block) {
 }
 
 static pool2_item_header *prev_block(const pool2_item_header *block) {
-    const unsigned prev_block_size = ((pool2_item_footer *)(block - 1))->size;
+    const size_t prev_block_size = ((pool2_item_footer *)(block - 1))->size;
     return (void *)((char *)block - prev_block_size);
 }
 
-struct pool2 *pool2_create(unsigned size) {
-    struct pool2 *pool = malloc(size);
-    if (!pool) {
-        return NULL;
+static pool2_item_header *last_block(const struct pool2 *pool) {
+    const pool2_item_footer *last = (void *)((char *)first_block(pool)
+            + pool->committed - sizeof(pool2_item_footer));
+    return (void *)((char *)(last + 1) - last->size);
+}
+
+static pool2_item_header *block_at(const struct pool2 *pool, uint32_t offset) {
+    return (void *)((char *)pool + (size_t)offset * 8);
+}
+
+static uint32_t block_offset(
+        const struct pool2 *pool,
+        const pool2_item_header *block) {
+    return ((char *)block - (char *)pool) / 8;
+}
+
+static pool2_free_links *links(const pool2_item_header *block) {
+    return (void *)(block + 1);
+}
+
+static void push_free(struct pool2 *pool, pool2_item_header *block) {
+    links(block)->next = pool->free;
+    links(block)->prev = 0;
+    if (pool->free) {
+        links(block_at(pool, pool->free))->prev = block_offset(pool, block);
     }
+    pool->free = block_offset(pool, block);
+    ++pool->free_blocks;
+}
 
-    pool->size = size;
+static void unlink_free(struct pool2 *pool, pool2_item_header *block) {
+    const pool2_free_links *l = links(block);
+    if (l->next) {
+        links(block_at(pool, l->next))->prev = l->prev;
+    }
+    if (l->prev) {
+        links(block_at(pool, l->prev))->next = l->next;
+    } else {
+        pool->free = l->next;
+    }
+    --pool->free_blocks;
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    const uint32_t x = *(const uint32_t *)a;
+    const uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Checks that the blocks of a shared pool cover its arena and that the free
+// list holds exactly its free blocks, which catches a pool that was left in
+// the middle of an allocation or a free. The counts that follow from the
+// blocks are taken from them.
+static bool check_blocks(struct pool2 *pool) {
+    if (pool->committed != pool->size || pool->size % 8
+            || pool->size < MIN_BLOCK_SIZE) {
+        return false;
+    }
+
+    size_t offset = 0;
+    size_t free_blocks = 0;
+    size_t used_blocks = 0;
+    size_t allocated = 0;
+    bool prev_free = false;
+    for (;;) {
+        const pool2_item_header *block =
+                (void *)((char *)first_block(pool) + offset);
+        if (pool->size - offset < MIN_BLOCK_SIZE
+                || block->size < MIN_BLOCK_SIZE || block->size % 8
+                || block->size > pool->size - offset
+                || block->first != !offset
+                || footer(block)->size != block->size) {
+            return false;
+        }
+
+        offset += block->size;
+        if (footer(block)->last != (offset == pool->size)) {
+            return false;
+        }
+
+        if (block->in_use) {
+            ++used_blocks;
+            allocated += block->size;
+        } else if (prev_free) {
+            // Neighbouring free blocks are always merged.
+            return false;
+        } else {
+            ++free_blocks;
+        }
+        prev_free = !block->in_use;
+
+        if (footer(block)->last) {
+            break;
+        }
+    }
+
+    // The free list may only hold blocks the walk found, so their offsets
+    // are collected, in order, to look the list up in.
+    uint32_t *offsets = malloc(free_blocks * sizeof(*offsets) + 1);
+    if (!offsets) {
+        return false;
+    }
+    size_t found = 0;
+    for (const pool2_item_header *block = first_block(pool);;
+            block = next_block(block)) {
+        if (!block->in_use) {
+            offsets[found++] = block_offset(pool, block);
+        }
+        if (footer(block)->last) {
+            break;
+        }
+    }
+
+    const char *end = (char *)first_block(pool) + pool->size;
+    bool listed_ok = true;
+    size_t listed = 0;
+    uint32_t prev = 0;
+    for (uint32_t next = pool->free; next;) {
+        const pool2_item_header *block = block_at(pool, next);
+        if (++listed > free_blocks
+                || !bsearch(&next, offsets, free_blocks, sizeof(*offsets),
+                        compare_offsets)
+                || block->size > (size_t)(end - (char *)block)
+                || links(block)->prev != prev) {
+            listed_ok = false;
+            break;
+        }
+        prev = next;
+        next = links(block)->next;
+    }
+    free(offsets);
+    if (!listed_ok || listed != free_blocks) {
+        return false;
+    }
+
+    pool->free_blocks = free_blocks;
+    pool->used_blocks = used_blocks;
+    pool->allocated = allocated;
+    return true;
+}
+
+// Returns false if the pool can't be used any more.
+static bool lock(const struct pool2 *pool) {
+    if (!pool->shared) {
+        return true;
+    }
+
+    pthread_mutex_t *m = &((struct pool2 *)pool)->lock;
+    const int error = pthread_mutex_lock(m);
+    if (error == EOWNERDEAD) {
+        // A process died holding the lock, maybe halfway through changing
+        // the pool. If the blocks don't check out, the lock is given up
+        // without being made consistent, and every later lock fails with
+        // ENOTRECOVERABLE.
+        if (!check_blocks((struct pool2 *)pool)) {
+            pthread_mutex_unlock(m);
+            return false;
+        }
+        pthread_mutex_consistent(m);
+        return true;
+    }
+    return !error;
+}
+
+static void unlock(const struct pool2 *pool) {
+    if (pool->shared) {
+        pthread_mutex_unlock(&((struct pool2 *)pool)->lock);
+    }
+}
+
+static void init_pool(struct pool2 *pool) {
+    pool->magic = POOL2_MAGIC;
+    pool->shared = false;
+    pool->root = 0;
+    pool->free = 0;
+    pool->free_blocks = 0;
+    pool->growth = POOL2_GROW_NONE;
+    pool->chunk = 0;
+    pool->total_size = pool->size;
+    pool->next_arena = NULL;
+    pool->allocated = 0;
+    pool->used_blocks = 0;
+    pool->peak_allocated = 0;
+    pool->allocs = 0;
+    pool->frees = 0;
+    pool->failures = 0;
 
     pool2_item_header *block = first_block(pool);
-    block->size = size;
+    block->size = pool->committed;
     block->in_use = false;
     block->first = true;
 
     footer(block)->size = block->size;
     footer(block)->last = true;
 
+    push_free(pool, block);
+}
+
+// Commits enough of the reserved arena for a free block of at least size
+// bytes to sit at the end of it.
+static bool commit(struct pool2 *pool, size_t size) {
+    pool2_item_header *last = last_block(pool);
+    const size_t needed = last->in_use ? size : size - last->size;
+    if (needed > pool->size - pool->committed) {
+        return false;
+    }
+
+    const size_t start = FIRST_BLOCK_OFFSET + pool->committed;
+    size_t end = (start + needed + pool->commit_step - 1)
+            / pool->commit_step * pool->commit_step;
+    if (end > FIRST_BLOCK_OFFSET + pool->size) {
+        end = FIRST_BLOCK_OFFSET + pool->size;
+    }
+
+    if (mprotect((char *)pool + start, end - start, PROT_READ | PROT_WRITE)) {
+        return false;
+    }
+
+    const size_t grown = end - start;
+    pool->committed += grown;
+
+    if (!last->in_use) {
+        last->size += grown;
+        footer(last)->size = last->size;
+        footer(last)->last = true;
+        return true;
+    }
+
+    footer(last)->last = false;
+
+    pool2_item_header *block = next_block(last);
+    block->size = grown;
+    block->in_use = false;
+    block->first = false;
+    footer(block)->size = grown;
+    footer(block)->last = true;
+    push_free(pool, block);
+    return true;
+}
+
+struct pool2 *pool2_create(size_t size) {
+    // Blocks need to be a multiple of 8 bytes to keep footers aligned.
+    size -= size % 8;
+    if (size < MIN_BLOCK_SIZE || size > MAX_POOL_SIZE) {
+        return NULL;
+    }
+
+    struct pool2 *pool = malloc(FIRST_BLOCK_OFFSET + size);
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->size = size;
+    pool->committed = size;
+    pool->commit_step = 0;
+    pool->mapped = false;
+    pool->node = -1;
+    init_pool(pool);
+
     return pool;
 }
 
+static struct pool2 *map_pool(size_t size, unsigned flags, int node) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t step = flags & (POOL2_MAP_THP | POOL2_MAP_HUGETLB)
+            ? HUGE_PAGE_SIZE
+            : page_size * 16;
+
+    if (size < MIN_BLOCK_SIZE || size > MAX_POOL_SIZE) {
+        return NULL;
+    }
+
+    size_t length = (FIRST_BLOCK_OFFSET + size + step - 1) / step * step;
+    if (length - FIRST_BLOCK_OFFSET > MAX_POOL_SIZE) {
+        length -= step;
+    }
+    // Transparent huge pages need 2 MiB aligned memory, so reserve an extra
+    // huge page and trim whatever is left over on either side.
+    const size_t slack = flags & POOL2_MAP_THP ? HUGE_PAGE_SIZE : 0;
+    const int map_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+            | (flags & POOL2_MAP_HUGETLB ? MAP_HUGETLB : 0);
+
+    char *mem = mmap(NULL, length + slack, PROT_NONE, map_flags, -1, 0);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (slack) {
+        const size_t head = (HUGE_PAGE_SIZE
+                - (uintptr_t)mem % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+        if (head) {
+            munmap(mem, head);
+        }
+        if (slack - head) {
+            munmap(mem + head + length, slack - head);
+        }
+        mem += head;
+        // Huge pages are only a hint, we're fine without them.
+        madvise(mem, length, MADV_HUGEPAGE);
+    }
+
+    // Nothing has been touched yet, so every page will come from the node.
+    if (node >= 0 && numa_util_bind(mem, length, node)) {
+        munmap(mem, length);
+        return NULL;
+    }
+
+    if (mprotect(mem, step, PROT_READ | PROT_WRITE)) {
+        munmap(mem, length);
+        return NULL;
+    }
+
+    struct pool2 *pool = (struct pool2 *)mem;
+    pool->size = length - FIRST_BLOCK_OFFSET;
+    pool->committed = step - FIRST_BLOCK_OFFSET;
+    pool->commit_step = step;
+    pool->mapped = true;
+    pool->node = node;
+    init_pool(pool);
+
+    return pool;
+}
+
+struct pool2 *pool2_create_mapped(size_t size, unsigned flags) {
+    return map_pool(size, flags, -1);
+}
+
+struct pool2 *pool2_create_on_node(size_t size, int node, unsigned flags) {
+    if (node < 0) {
+        return NULL;
+    }
+    return map_pool(size, flags, node);
+}
+
+// The kernel's id for the running boot, or an empty string if it can't be
+// read.
+static void read_boot_id(char id[BOOT_ID_SIZE]) {
+    memset(id, 0, BOOT_ID_SIZE);
+    const int fd = open("/proc/sys/kernel/random/boot_id",
+            O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (read(fd, id, BOOT_ID_SIZE - 1) != BOOT_ID_SIZE - 1) {
+        memset(id, 0, BOOT_ID_SIZE);
+    }
+    close(fd);
+}
+
+static int init_lock(struct pool2 *pool) {
+    read_boot_id(pool->lock_boot);
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    const int error = pthread_mutex_init(&pool->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return error;
+}
+
+struct pool2 *pool2_create_shared(int fd, size_t size) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    if (size < MIN_BLOCK_SIZE || size > MAX_POOL_SIZE) {
+        return NULL;
+    }
+
+    const size_t length = (FIRST_BLOCK_OFFSET + size + page_size - 1)
+            / page_size * page_size;
+    if (ftruncate(fd, length)) {
+        return NULL;
+    }
+
+    struct pool2 *pool =
+            mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (pool == MAP_FAILED) {
+        return NULL;
+    }
+    if (init_lock(pool)) {
+        munmap(pool, length);
+        return NULL;
+    }
+
+    // The pool takes up the whole mapping. It's already backed by the file,
+    // so there's nothing to commit.
+    pool->size = (length - FIRST_BLOCK_OFFSET) / 8 * 8;
+    pool->committed = pool->size;
+    pool->commit_step = 0;
+    pool->mapped = true;
+    pool->node = -1;
+    init_pool(pool);
+    pool->shared = true;
+
+    return pool;
+}
+
+struct pool2 *pool2_attach(int fd) {
+    struct stat st;
+    if (fstat(fd, &st)
+            || (size_t)st.st_size < FIRST_BLOCK_OFFSET + MIN_BLOCK_SIZE) {
+        return NULL;
+    }
+
+    const size_t length = st.st_size;
+    struct pool2 *pool =
+            mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (pool == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (pool->magic != POOL2_MAGIC || !pool->shared
+            || pool->size > length - FIRST_BLOCK_OFFSET) {
+        munmap(pool, length);
+        return NULL;
+    }
+
+    return pool;
+}
+
+static struct pool2 *open_pool(int fd, size_t length) {
+    if (length < FIRST_BLOCK_OFFSET + MIN_BLOCK_SIZE) {
+        return NULL;
+    }
+
+    struct pool2 *pool =
+            mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (pool == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (pool->magic != POOL2_MAGIC || !pool->shared || pool->next_arena
+            || pool->size > length - FIRST_BLOCK_OFFSET) {
+        munmap(pool, length);
+        return NULL;
+    }
+
+    // Processes that attached to the pool can still be using it, and the
+    // lock is robust, so a holder that died doesn't leave it locked. A lock
+    // written before a reboot can only have been held by a process that's
+    // gone, and is set up again. When either boot isn't known, the pool may
+    // still be in use and the lock is taken as usual.
+    char boot[BOOT_ID_SIZE];
+    read_boot_id(boot);
+    bool ok;
+    if (boot[0] && pool->lock_boot[0]
+            && memcmp(boot, pool->lock_boot, sizeof(boot))) {
+        ok = check_blocks(pool) && !init_lock(pool);
+    } else if (lock(pool)) {
+        ok = check_blocks(pool);
+        unlock(pool);
+    } else {
+        ok = false;
+    }
+    if (!ok) {
+        munmap(pool, length);
+        return NULL;
+    }
+
+    return pool;
+}
+
+// The descriptors that keep the files of pools opened with pool2_open_file
+// locked. They belong to this process, so they're kept here and not in the
+// pools, which other processes map too.
+struct open_file {
+    const struct pool2 *pool;
+    int fd;
+    struct open_file *next;
+};
+
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct open_file *open_files;
+
+// Returns the descriptor pool was opened with, or -1 if it wasn't opened
+// from a file, and forgets it.
+static int take_open_file(const struct pool2 *pool) {
+    int fd = -1;
+    pthread_mutex_lock(&open_files_lock);
+    for (struct open_file **f = &open_files; *f; f = &(*f)->next) {
+        if ((*f)->pool == pool) {
+            struct open_file *found = *f;
+            *f = found->next;
+            fd = found->fd;
+            free(found);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return fd;
+}
+
+struct pool2 *pool2_open_file(const char *path, size_t size) {
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // The lock goes with fd, so only one pool at a time has the file open,
+    // even within a process.
+    struct pool2 *pool = NULL;
+    struct open_file *file = malloc(sizeof(*file));
+    struct stat st;
+    if (file && !flock(fd, LOCK_EX | LOCK_NB) && !fstat(fd, &st)) {
+        pool = st.st_size
+                ? open_pool(fd, st.st_size)
+                : pool2_create_shared(fd, size);
+    }
+    if (!pool) {
+        free(file);
+        close(fd);
+        return NULL;
+    }
+
+    file->pool = pool;
+    file->fd = fd;
+    pthread_mutex_lock(&open_files_lock);
+    file->next = open_files;
+    open_files = file;
+    pthread_mutex_unlock(&open_files_lock);
+    return pool;
+}
+
+int pool2_checkpoint(struct pool2 *pool) {
+    if (!pool->shared) {
+        return -1;
+    }
+
+    if (!lock(pool)) {
+        return -1;
+    }
+    const int error = msync(pool, FIRST_BLOCK_OFFSET + pool->size, MS_SYNC);
+    unlock(pool);
+    return error ? -1 : 0;
+}
+
+void pool2_set_root(struct pool2 *pool, pool2_handle root) {
+    if (!lock(pool)) {
+        return;
+    }
+    pool->root = root;
+    unlock(pool);
+}
+
+pool2_handle pool2_root(const struct pool2 *pool) {
+    if (!lock(pool)) {
+        return 0;
+    }
+    const pool2_handle root = pool->root;
+    unlock(pool);
+    return root;
+}
+
+pool2_handle pool2_to_handle(const struct pool2 *pool, const void *ptr) {
+    return ptr ? (pool2_handle)((const char *)ptr - (const char *)pool) : 0;
+}
+
+void *pool2_from_handle(const struct pool2 *pool, pool2_handle handle) {
+    return handle ? (char *)pool + handle : NULL;
+}
+
+static void destroy_arena(struct pool2 *pool) {
+    if (pool->mapped) {
+        munmap(pool, FIRST_BLOCK_OFFSET + pool->size);
+    } else {
+        free(pool);
+    }
+}
+
 void pool2_destroy(struct pool2 *pool) {
-    free(pool);
+    while (pool->next_arena) {
+        struct pool2 *arena = pool->next_arena;
+        pool->next_arena = arena->next_arena;
+        destroy_arena(arena);
+    }
+
+    const int fd = pool->shared ? take_open_file(pool) : -1;
+    destroy_arena(pool);
+    if (fd >= 0) {
+        close(fd);
+    }
 }
 
-void *pool2_alloc(struct pool2 *pool, unsigned size) {
+void pool2_set_growth(
+        struct pool2 *pool,
+        enum pool2_growth growth,
+        size_t chunk) {
+    if (pool->shared) {
+        return;
+    }
+    pool->growth = growth;
+    pool->chunk = chunk;
+}
+
+void pool2_trim(struct pool2 *pool) {
+    for (struct pool2 **link = &pool->next_arena; *link;) {
+        struct pool2 *arena = *link;
+        const pool2_item_header *block = first_block(arena);
+        if (block->in_use || !footer(block)->last) {
+            link = &arena->next_arena;
+            continue;
+        }
+
+        *link = arena->next_arena;
+        pool->total_size -= arena->size;
+        destroy_arena(arena);
+    }
+}
+
+static struct pool2 *arena_of(struct pool2 *pool, const void *ptr) {
+    for (struct pool2 *arena = pool; arena; arena = arena->next_arena) {
+        const char *start = (char *)first_block(arena);
+        if ((char *)ptr > start && (char *)ptr < start + arena->committed) {
+            return arena;
+        }
+    }
+
+    return NULL;
+}
+
+static size_t to_block_size(size_t size) {
     size += (8 - size % 8) % 8;
     size += ALLOCATION_OVERHEAD;
+    return size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : size;
+}
 
-    for (pool2_item_header *block = first_block(pool);
-            ;
-            block = next_block(block)) {
-        if (block->in_use) {
-            if (footer(block)->last) {
+static void *arena_alloc(struct pool2 *pool, size_t size) {
+    if (size > pool->size) {
+        return NULL;
+    }
+
+    size = to_block_size(size);
+
+    for (uint32_t offset = pool->free; ; ) {
+        if (!offset) {
+            if (pool->committed == pool->size || !commit(pool, size)) {
                 return NULL;
             }
-            continue;
+            // The free block at the end of the arena now fits.
+            offset = block_offset(pool, last_block(pool));
         }
 
+        pool2_item_header *block = block_at(pool, offset);
         if (block->size < size) {
-            if (footer(block)->last) {
-                return NULL;
-            }
+            offset = links(block)->next;
             continue;
         }
 
+        unlink_free(pool, block);
         block->in_use = true;
 
         // Is the block big enough to split?
-        if (block->size - size > ALLOCATION_OVERHEAD) {
-            const unsigned new_size = block->size - size;
+        if (block->size - size >= MIN_BLOCK_SIZE) {
+            const size_t new_size = block->size - size;
             block->size = size;
             footer(block)->size = size;
             footer(block)->last = false;
@@ -99,21 +749,205 @@ void *pool2_alloc(struct pool2 *pool, unsigned size) {
             footer(new_block)->size = new_size;
             // footer(new_block)->last is inherited from the last block that
             // lived here.
+            push_free(pool, new_block);
         }
 
         return block + 1;
     }
 }
 
-void pool2_free(struct pool2 *pool, void *ptr) {
-    if (!ptr) return;
+// Splits up to n blocks of size bytes off a free block in one go and returns
+// how many it split off. What's left goes back as one free block.
+static size_t arena_carve(
+        struct pool2 *pool,
+        pool2_item_header *block,
+        size_t size,
+        size_t n,
+        void **out) {
+    unlink_free(pool, block);
+    const bool first = block->first;
+    const bool last = footer(block)->last;
+    size_t left = block->size;
+    size_t count = 0;
 
-    pool2_item_header *block = (pool2_item_header *)ptr - 1;
+    pool2_item_header *carved = block;
+    for (; count < n && left >= size; ++count, left -= size) {
+        carved = (void *)((char *)block + count * size);
+        carved->size = size;
+        carved->in_use = true;
+        carved->first = first && count == 0;
+        footer(carved)->size = size;
+        footer(carved)->last = false;
+        out[count] = carved + 1;
+    }
+
+    if (left >= MIN_BLOCK_SIZE) {
+        pool2_item_header *new_block = next_block(carved);
+        new_block->size = left;
+        new_block->in_use = false;
+        new_block->first = false;
+        footer(new_block)->size = left;
+        footer(new_block)->last = last;
+        push_free(pool, new_block);
+    } else {
+        carved->size += left;
+        footer(carved)->size = carved->size;
+        footer(carved)->last = last;
+    }
+
+    return count;
+}
+
+static pool2_item_header *find_fit(const struct pool2 *pool, size_t size) {
+    for (uint32_t offset = pool->free; offset; ) {
+        pool2_item_header *block = block_at(pool, offset);
+        if (block->size >= size) {
+            return block;
+        }
+        offset = links(block)->next;
+    }
+
+    return NULL;
+}
+
+static struct pool2 *add_arena(struct pool2 *pool, size_t size) {
+    size_t arena_size =
+            pool->growth == POOL2_GROW_DOUBLE ? pool->total_size : pool->chunk;
+    if (size > MAX_POOL_SIZE - MIN_BLOCK_SIZE) {
+        return NULL;
+    }
+    if (arena_size < size + MIN_BLOCK_SIZE) {
+        arena_size = size + MIN_BLOCK_SIZE;
+    }
+    if (arena_size > MAX_POOL_SIZE) {
+        arena_size = MAX_POOL_SIZE;
+    }
+
+    // Arenas of a pool bound to a node are mapped on the same node.
+    struct pool2 *arena = pool->node >= 0
+            ? map_pool(arena_size, 0, pool->node)
+            : pool2_create(arena_size);
+    if (!arena) {
+        return NULL;
+    }
+
+    // Newer arenas are bigger, so they go first after the original one.
+    arena->next_arena = pool->next_arena;
+    pool->next_arena = arena;
+    pool->total_size += arena->size;
+    return arena;
+}
+
+static void *chain_alloc(struct pool2 *pool, size_t size) {
+    for (struct pool2 *arena = pool; arena; arena = arena->next_arena) {
+        void *ptr = arena_alloc(arena, size);
+        if (ptr) {
+            return ptr;
+        }
+    }
+
+    if (pool->growth == POOL2_GROW_NONE) {
+        return NULL;
+    }
+
+    struct pool2 *arena = add_arena(pool, size);
+    return arena ? arena_alloc(arena, size) : NULL;
+}
+
+static void count_allocated(struct pool2 *pool, size_t size) {
+    pool->allocated += size;
+    if (pool->allocated > pool->peak_allocated) {
+        pool->peak_allocated = pool->allocated;
+    }
+}
+
+static void *alloc(struct pool2 *pool, size_t size) {
+    void *ptr = chain_alloc(pool, size);
+    if (!ptr) {
+        ++pool->failures;
+        return NULL;
+    }
+
+    ++pool->allocs;
+    ++pool->used_blocks;
+    count_allocated(pool, ((pool2_item_header *)ptr - 1)->size);
+    return ptr;
+}
+
+// pool2_alloc and pool2_free without their tracing. Only the public calls
+// trace, so one that's built on another still records its own caller.
+static void *locked_alloc(struct pool2 *pool, size_t size) {
+    if (!lock(pool)) {
+        return NULL;
+    }
+    void *ptr = alloc(pool, size);
+    unlock(pool);
+    return ptr;
+}
+
+void *pool2_alloc(struct pool2 *pool, size_t size) {
+    void *ptr = locked_alloc(pool, size);
+    TRACE_ALLOC(pool, ptr, size);
+    return ptr;
+}
+
+size_t pool2_alloc_batch(
+        struct pool2 *pool,
+        size_t size,
+        size_t n,
+        void **out) {
+    size_t count = 0;
+    size_t allocated = 0;
+
+    if (!lock(pool)) {
+        return 0;
+    }
+    while (size <= MAX_POOL_SIZE && count < n) {
+        size_t carved = 0;
+        for (struct pool2 *arena = pool; arena && !carved;
+                arena = arena->next_arena) {
+            pool2_item_header *block = find_fit(arena, to_block_size(size));
+            if (block) {
+                carved = arena_carve(arena, block, to_block_size(size),
+                        n - count, out + count);
+            }
+        }
+
+        if (!carved) {
+            // Nothing that's committed fits, so let the single block path
+            // commit more memory or grow the pool.
+            if (!(out[count] = chain_alloc(pool, size))) {
+                break;
+            }
+            carved = 1;
+        }
+
+        for (size_t i = count; i < count + carved; ++i) {
+            allocated += ((pool2_item_header *)out[i] - 1)->size;
+        }
+        count += carved;
+    }
+
+    pool->allocs += count;
+    pool->failures += n - count;
+    pool->used_blocks += count;
+    count_allocated(pool, allocated);
+    unlock(pool);
+#ifdef POOL_TRACING
+    for (size_t i = 0; i < count; ++i) {
+        TRACE_ALLOC(pool, out[i], size);
+    }
+#endif
+    return count;
+}
+
+static void arena_free(struct pool2 *pool, pool2_item_header *block) {
     block->in_use = false;
 
     if (!footer(block)->last) {
         pool2_item_header *next = next_block(block);
         if (!next->in_use) {
+            unlink_free(pool, next);
             block->size += next->size;
             footer(block)->size = block->size;
         }
@@ -122,56 +956,389 @@ void pool2_free(struct pool2 *pool, void *ptr) {
     if (!block->first) {
         pool2_item_header *prev = prev_block(block);
         if (!prev->in_use) {
+            // prev is already in the free list, it just grows.
             prev->size += block->size;
             footer(block)->size = prev->size;
+            return;
         }
     }
+
+    push_free(pool, block);
+}
+
+static void free_ptr(struct pool2 *pool, void *ptr) {
+    pool2_item_header *block = (pool2_item_header *)ptr - 1;
+    ++pool->frees;
+    --pool->used_blocks;
+    pool->allocated -= block->size;
+
+    arena_free(arena_of(pool, ptr), block);
+}
+
+static void locked_free(struct pool2 *pool, void *ptr) {
+    if (!lock(pool)) {
+        return;
+    }
+    free_ptr(pool, ptr);
+    unlock(pool);
 }
 
-unsigned pool2_available(const struct pool2 *pool) {
-    unsigned memory = 0;
-    for (pool2_item_header *i = first_block(pool);; i = next_block(i)) {
-        if (!i->in_use) {
-            memory += i->size;
+void pool2_free(struct pool2 *pool, void *ptr) {
+    if (!ptr) return;
+
+    TRACE_FREE(pool, ptr);
+    locked_free(pool, ptr);
+}
+
+// Gives back the end of a block in use if there's enough of it beyond size
+// bytes to be a block of its own.
+static void split_tail(
+        struct pool2 *pool,
+        pool2_item_header *block,
+        size_t size) {
+    if (block->size - size < MIN_BLOCK_SIZE) {
+        return;
+    }
+
+    pool2_item_header *tail = (void *)((char *)block + size);
+    tail->size = block->size - size;
+    tail->in_use = true;
+    tail->first = false;
+    footer(tail)->size = tail->size;
+
+    block->size = size;
+    footer(block)->size = size;
+    footer(block)->last = false;
+    arena_free(pool, tail);
+}
+
+// Grows or shrinks a block in use to size bytes without moving it, if the
+// block after it is free and big enough.
+static bool arena_resize(
+        struct pool2 *pool,
+        pool2_item_header *block,
+        size_t size) {
+    if (block->size < size) {
+        pool2_item_header *next =
+                footer(block)->last ? NULL : next_block(block);
+        const size_t room = block->size
+                + (next && !next->in_use ? next->size : 0);
+
+        // A mapped arena can commit more memory after its last block.
+        if (room < size && (!next || (!next->in_use && footer(next)->last))) {
+            if (pool->committed == pool->size
+                    || !commit(pool, size - block->size)) {
+                return false;
+            }
+            next = next_block(block);
         }
-        if (footer(i)->last) {
-            return memory;
+
+        if (!next || next->in_use || block->size + next->size < size) {
+            return false;
         }
+
+        unlink_free(pool, next);
+        block->size += next->size;
+        footer(block)->size = block->size;
+    }
+
+    split_tail(pool, block, size);
+    return true;
+}
+
+static void *realloc_ptr(struct pool2 *pool, void *ptr, size_t size) {
+    pool2_item_header *block = (pool2_item_header *)ptr - 1;
+    const size_t old_size = block->size;
+    if (size <= MAX_POOL_SIZE
+            && arena_resize(arena_of(pool, ptr), block, to_block_size(size))) {
+        pool->allocated -= old_size;
+        count_allocated(pool, block->size);
+        return ptr;
+    }
+
+    void *moved = alloc(pool, size);
+    if (!moved) {
+        return NULL;
+    }
+
+    memcpy(moved, ptr, old_size - ALLOCATION_OVERHEAD);
+    free_ptr(pool, ptr);
+    return moved;
+}
+
+void *pool2_realloc(struct pool2 *pool, void *ptr, size_t size) {
+    if (!ptr) {
+        void *allocated = locked_alloc(pool, size);
+        TRACE_ALLOC(pool, allocated, size);
+        return allocated;
+    }
+    if (!size) {
+        TRACE_FREE(pool, ptr);
+        locked_free(pool, ptr);
+        return NULL;
+    }
+
+    if (!lock(pool)) {
+        return NULL;
+    }
+    void *moved = realloc_ptr(pool, ptr, size);
+    unlock(pool);
+
+    if (moved == ptr) {
+        TRACE_FREE(pool, ptr);
+        TRACE_ALLOC(pool, ptr, size);
+    } else if (moved) {
+        TRACE_ALLOC(pool, moved, size);
+        TRACE_FREE(pool, ptr);
+    }
+    return moved;
+}
+
+static void *alloc_aligned(struct pool2 *pool, size_t size, size_t align) {
+    void *ptr = size <= MAX_POOL_SIZE && align <= MAX_POOL_SIZE
+            ? chain_alloc(pool, size + align + MIN_BLOCK_SIZE)
+            : NULL;
+    if (!ptr) {
+        ++pool->failures;
+        return NULL;
+    }
+
+    // The block has room to spare, the padding in front of the aligned
+    // payload and whatever's left after it go back as free blocks.
+    struct pool2 *arena = arena_of(pool, ptr);
+    pool2_item_header *block = (pool2_item_header *)ptr - 1;
+    size_t padding = (align - (uintptr_t)ptr % align) % align;
+    if (padding && padding < MIN_BLOCK_SIZE) {
+        padding += align;
+    }
+
+    pool2_item_header *lead = NULL;
+    if (padding) {
+        lead = block;
+        block = (void *)((char *)lead + padding);
+        block->size = lead->size - padding;
+        block->in_use = true;
+        block->first = false;
+        footer(block)->size = block->size;
+
+        lead->size = padding;
+        footer(lead)->size = padding;
+        footer(lead)->last = false;
+    }
+
+    split_tail(arena, block, to_block_size(size));
+    // The padding goes on the free list last, so it's the first to be
+    // handed out again.
+    if (lead) {
+        arena_free(arena, lead);
+    }
+
+    ++pool->allocs;
+    ++pool->used_blocks;
+    count_allocated(pool, block->size);
+    return block + 1;
+}
+
+void *pool2_alloc_aligned(struct pool2 *pool, size_t size, size_t align) {
+    if (!align || align & (align - 1)) {
+        return NULL;
     }
+
+    void *ptr = NULL;
+    if (align <= 8) {
+        ptr = locked_alloc(pool, size);
+    } else if (lock(pool)) {
+        ptr = alloc_aligned(pool, size, align);
+        unlock(pool);
+    }
+    TRACE_ALLOC(pool, ptr, size);
+    return ptr;
 }
 
-unsigned pool2_allocated(const struct pool2 *pool) {
-    unsigned memory = 0;
-    for (pool2_item_header *i = first_block(pool);; i = next_block(i)) {
-        if (i->in_use) {
-            memory += i->size;
+void pool2_free_batch(struct pool2 *pool, void **ptrs, size_t n) {
+#ifdef POOL_TRACING
+    for (size_t i = 0; i < n; ++i) {
+        TRACE_FREE(pool, ptrs[i]);
+    }
+#endif
+
+    if (!lock(pool)) {
+        return;
+    }
+    for (size_t k = 0; k < n;) {
+        if (!ptrs[k]) {
+            ++k;
+            continue;
         }
-        if (footer(i)->last) {
-            return memory;
+
+        // Blocks that follow each other in memory are merged before they're
+        // freed, so a run of them is only coalesced once.
+        pool2_item_header *run = (pool2_item_header *)ptrs[k++] - 1;
+        struct pool2 *arena = arena_of(pool, run + 1);
+        size_t blocks = 1;
+        pool->allocated -= run->size;
+        while (k < n && ptrs[k] && !footer(run)->last
+                && (pool2_item_header *)ptrs[k] - 1 == next_block(run)) {
+            const pool2_item_header *next = next_block(run);
+            pool->allocated -= next->size;
+            run->size += next->size;
+            footer(run)->size = run->size;
+            ++blocks;
+            ++k;
         }
+
+        pool->frees += blocks;
+        pool->used_blocks -= blocks;
+        arena_free(arena, run);
     }
+    unlock(pool);
 }
 
-unsigned pool2_free_blocks(const struct pool2 *pool) {
-    unsigned blocks = 0;
-    for (pool2_item_header *i = first_block(pool);; i = next_block(i)) {
-        if (!i->in_use) {
-            ++blocks;
+static size_t count_free_blocks(const struct pool2 *pool) {
+    size_t blocks = 0;
+    for (const struct pool2 *arena = pool; arena; arena = arena->next_arena) {
+        blocks += arena->free_blocks;
+    }
+    return blocks;
+}
+
+int pool2_owns(const struct pool2 *pool, const void *ptr) {
+    int owns = 0;
+    if (!lock(pool)) {
+        return 0;
+    }
+    for (const struct pool2 *arena = pool; arena && !owns;
+            arena = arena->next_arena) {
+        const char *start = (char *)first_block(arena);
+        owns = (const char *)ptr >= start
+                && (const char *)ptr < start + arena->size;
+    }
+    unlock(pool);
+    return owns;
+}
+
+size_t pool2_available(const struct pool2 *pool) {
+    if (!lock(pool)) {
+        return 0;
+    }
+    // Memory that hasn't been committed yet is free for the taking.
+    const size_t available = pool->total_size - pool->allocated;
+    unlock(pool);
+    return available;
+}
+
+size_t pool2_allocated(const struct pool2 *pool) {
+    if (!lock(pool)) {
+        return 0;
+    }
+    const size_t allocated = pool->allocated;
+    unlock(pool);
+    return allocated;
+}
+
+size_t pool2_free_blocks(const struct pool2 *pool) {
+    if (!lock(pool)) {
+        return 0;
+    }
+    const size_t blocks = count_free_blocks(pool);
+    unlock(pool);
+    return blocks;
+}
+
+size_t pool2_used_blocks(const struct pool2 *pool) {
+    if (!lock(pool)) {
+        return 0;
+    }
+    const size_t blocks = pool->used_blocks;
+    unlock(pool);
+    return blocks;
+}
+
+void pool2_get_stats(const struct pool2 *pool, struct pool2_stats *stats) {
+    if (!lock(pool)) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    size_t largest = 0;
+    for (const struct pool2 *arena = pool; arena; arena = arena->next_arena) {
+        for (uint32_t offset = arena->free; offset; ) {
+            const pool2_item_header *block = block_at(arena, offset);
+            if (block->size > largest) {
+                largest = block->size;
+            }
+            offset = links(block)->next;
         }
-        if (footer(i)->last) {
-            return blocks;
+        // The free block at the end of a mapped arena can still grow into
+        // the memory that isn't committed yet.
+        if (arena->committed < arena->size) {
+            const pool2_item_header *last = last_block(arena);
+            size_t size = arena->size - arena->committed;
+            if (!last->in_use) {
+                size += last->size;
+            }
+            if (size > largest) {
+                largest = size;
+            }
         }
     }
+
+    stats->available = pool->total_size - pool->allocated;
+    stats->allocated = pool->allocated;
+    stats->free_blocks = count_free_blocks(pool);
+    stats->used_blocks = pool->used_blocks;
+    stats->peak_allocated = pool->peak_allocated;
+    stats->largest_free_block = largest;
+    stats->allocs = pool->allocs;
+    stats->frees = pool->frees;
+    stats->failures = pool->failures;
+    unlock(pool);
 }
 
-unsigned pool2_used_blocks(const struct pool2 *pool) {
-    unsigned blocks = 0;
-    for (pool2_item_header *i = first_block(pool);; i = next_block(i)) {
-        if (i->in_use) {
-            ++blocks;
-        }
-        if (footer(i)->last) {
-            return blocks;
+void pool2_walk(const struct pool2 *pool, pool2_walk_fn visit, void *arg) {
+    if (!lock(pool)) {
+        return;
+    }
+    unsigned index = 0;
+    for (const struct pool2 *arena = pool; arena; arena = arena->next_arena) {
+        for (pool2_item_header *i = first_block(arena);; i = next_block(i)) {
+            const struct pool2_block block = {
+                .arena = index,
+                .offset = (char *)i - (char *)first_block(arena),
+                .size = i->size,
+                .in_use = i->in_use,
+            };
+            visit(arg, &block);
+            if (footer(i)->last) {
+                break;
+            }
         }
+        ++index;
+    }
+    unlock(pool);
+}
+
+static void count_fragment(void *arg, const struct pool2_block *block) {
+    struct pool2_fragmentation *f = arg;
+    if (block->in_use) {
+        return;
+    }
+
+    f->free_bytes += block->size;
+    ++f->free_blocks;
+    if (block->size > f->largest_free_block) {
+        f->largest_free_block = block->size;
+    }
+    ++f->histogram[63 - __builtin_clzll(block->size)];
+}
+
+void pool2_get_fragmentation(
+        const struct pool2 *pool,
+        struct pool2_fragmentation *fragmentation) {
+    memset(fragmentation, 0, sizeof(*fragmentation));
+    pool2_walk(pool, count_fragment, fragmentation);
+    if (fragmentation->free_bytes) {
+        fragmentation->fragmentation = 1.0
+                - (double)fragmentation->largest_free_block
+                        / fragmentation->free_bytes;
     }
 }
@@ -1,25 +1,182 @@
 #ifndef POOL2_H_
 #define POOL2_H_
 
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 struct pool2;
 
-struct pool2 *pool2_create(unsigned size);
+enum pool2_map_flags {
+    // Ask for transparent huge pages. This is only a hint to the kernel.
+    POOL2_MAP_THP = 1 << 0,
+    // Back the pool with explicit huge pages. Creating the pool fails if the
+    // system doesn't have enough of them.
+    POOL2_MAP_HUGETLB = 1 << 1,
+};
+
+// What a pool does when it runs out of memory.
+enum pool2_growth {
+    // Fail the allocation.
+    POOL2_GROW_NONE,
+    // Add an arena as big as all of the pool's arenas together.
+    POOL2_GROW_DOUBLE,
+    // Add an arena of a fixed size.
+    POOL2_GROW_FIXED,
+};
+
+// Pools can be up to 32 GiB.
+struct pool2 *pool2_create(size_t size);
+// Reserves address space for size bytes with mmap and only commits memory
+// as the pool's high-water mark grows.
+struct pool2 *pool2_create_mapped(size_t size, unsigned flags);
+// Like pool2_create_mapped, but the pool's memory and any arenas it grows
+// come from the NUMA node given. See numa_util.h.
+struct pool2 *pool2_create_on_node(size_t size, int node, unsigned flags);
 void pool2_destroy(struct pool2 *pool);
 
-void *pool2_alloc(struct pool2 *pool, unsigned size);
+// Shared pools live in a file, usually a memfd or a shm_open segment, that
+// several processes map at once. Allocations and frees from any of them are
+// serialized by a process-shared mutex kept in the pool. Each process maps
+// the pool at its own address, so blocks are passed around as handles.
+// Shared pools never grow.
+//
+// The mutex is robust. When a process dies holding it, the next process to
+// lock it checks the pool's blocks like pool2_open_file does. If they check
+// out, the pool is used from then on, minus whatever blocks the dead
+// process was allocating. If they don't, the pool is poisoned in every
+// process: allocations return NULL, frees do nothing and the counts read 0.
+//
+// pool2_create_shared sizes fd to fit the pool and sets it up. Other
+// processes get at it with pool2_attach and the same file. pool2_destroy
+// only unmaps the pool from the calling process, the pool lives as long as
+// the file does.
+struct pool2 *pool2_create_shared(int fd, size_t size);
+struct pool2 *pool2_attach(int fd);
+
+// Handles are the offset of a block in its pool and work in every process
+// that maps it. NULL is handle 0.
+typedef uint64_t pool2_handle;
+
+pool2_handle pool2_to_handle(const struct pool2 *pool, const void *ptr);
+void *pool2_from_handle(const struct pool2 *pool, pool2_handle handle);
+
+// Opens the shared pool kept in the file at path, or creates one of size
+// bytes if the file is empty or doesn't exist. An existing pool keeps its
+// size and has its blocks checked before it's used, a file that doesn't
+// hold a pool or holds a damaged one isn't opened. The file's pages are
+// read in as they're touched. The file stays locked with flock until
+// pool2_destroy, and opening a file that's locked fails, so only one pool
+// has it open at a time. Other processes can pool2_attach to it. Files can
+// only be read back by the same build of pool2 on the same platform.
+struct pool2 *pool2_open_file(const char *path, size_t size);
+// Writes the pool back to its file with msync. Changes made after a
+// checkpoint can reach the file at any time, so a pool that was in use
+// when its process died may not open again. Returns 0, or -1 if the pool
+// isn't shared or msync fails.
+int pool2_checkpoint(struct pool2 *pool);
+
+// A handle that outlives the process, for finding the blocks in a pool that
+// was opened from a file. It's 0 for new pools.
+void pool2_set_root(struct pool2 *pool, pool2_handle root);
+pool2_handle pool2_root(const struct pool2 *pool);
+
+// chunk is the size of new arenas for POOL2_GROW_FIXED. An arena is never
+// smaller than the allocation that triggered it.
+void pool2_set_growth(
+        struct pool2 *pool,
+        enum pool2_growth growth,
+        size_t chunk);
+// Gives arenas the pool added to grow back to the system once they're empty.
+void pool2_trim(struct pool2 *pool);
+
+void *pool2_alloc(struct pool2 *pool, size_t size);
+// align has to be a power of two. The padding in front of the block goes
+// back to the pool as a free block.
+void *pool2_alloc_aligned(struct pool2 *pool, size_t size, size_t align);
+// Grows or shrinks the block in place when the block after it has room, and
+// only moves it otherwise. A NULL ptr allocates and a size of 0 frees.
+void *pool2_realloc(struct pool2 *pool, void *ptr, size_t size);
 void pool2_free(struct pool2 *pool, void *ptr);
 
-unsigned pool2_available(const struct pool2 *pool);
-unsigned pool2_allocated(const struct pool2 *pool);
-unsigned pool2_free_blocks(const struct pool2 *pool);
-unsigned pool2_used_blocks(const struct pool2 *pool);
+// Allocates n blocks of size bytes at once and returns how many it could
+// get. The blocks are carved out of as few free blocks as possible.
+size_t pool2_alloc_batch(
+        struct pool2 *pool,
+        size_t size,
+        size_t n,
+        void **out);
+// Frees n blocks at once. Blocks that follow each other in memory, like the
+// ones pool2_alloc_batch hands out, are coalesced in one go when they're
+// next to each other in ptrs too.
+void pool2_free_batch(struct pool2 *pool, void **ptrs, size_t n);
+
+// Returns 1 if ptr points into one of the pool's arenas, 0 otherwise. That
+// includes memory a mapped pool hasn't committed yet.
+int pool2_owns(const struct pool2 *pool, const void *ptr);
+
+size_t pool2_available(const struct pool2 *pool);
+size_t pool2_allocated(const struct pool2 *pool);
+size_t pool2_free_blocks(const struct pool2 *pool);
+size_t pool2_used_blocks(const struct pool2 *pool);
+
+struct pool2_stats {
+    size_t available;
+    size_t allocated;
+    size_t free_blocks;
+    size_t used_blocks;
+    // The most memory that has been allocated at once.
+    size_t peak_allocated;
+    size_t largest_free_block;
+    size_t allocs;
+    size_t frees;
+    // Allocations that returned NULL.
+    size_t failures;
+};
+
+// Finding the largest free block walks the free lists, everything else is
+// counted as the pool is used.
+void pool2_get_stats(const struct pool2 *pool, struct pool2_stats *stats);
+
+struct pool2_block {
+    // Arenas are numbered in the order they're walked, the pool's own first.
+    unsigned arena;
+    // From the start of the arena.
+    size_t offset;
+    size_t size;
+    int in_use;
+};
+
+typedef void (*pool2_walk_fn)(void *arg, const struct pool2_block *block);
+
+// Calls visit for every block of every arena in address order. Memory a
+// mapped pool hasn't committed yet isn't part of any block.
+void pool2_walk(const struct pool2 *pool, pool2_walk_fn visit, void *arg);
+
+#define POOL2_HISTOGRAM_BUCKETS 64
+
+struct pool2_fragmentation {
+    size_t free_bytes;
+    size_t free_blocks;
+    size_t largest_free_block;
+    // 1 - largest_free_block / free_bytes. 0 means all free memory is in one
+    // block, and it gets closer to 1 the more it's split up.
+    double fragmentation;
+    // histogram[n] counts the free blocks of at least 2^n bytes and less
+    // than 2^(n + 1).
+    size_t histogram[POOL2_HISTOGRAM_BUCKETS];
+};
+
+// Only looks at committed memory, see pool2_walk.
+void pool2_get_fragmentation(
+        const struct pool2 *pool,
+        struct pool2_fragmentation *fragmentation);
 
 #ifdef __cplusplus
 }
 #endif
 
-#endif POOL2_H_
+#endif
@@ -0,0 +1,30 @@
+#ifndef POOL2_FORMAT_H_
+#define POOL2_FORMAT_H_
+
+// The layout of pool2 blocks, shared with static_pool.h. Every block starts
+// with a header and ends with a footer that both carry its size, so blocks
+// can be walked in either direction. Blocks are multiples of 8 bytes.
+
+#include <stdint.h> // uint32_t, uint64_t
+
+typedef struct pool2_item_header {
+    uint64_t size : 62;
+    uint64_t in_use : 1;
+    uint64_t first : 1; // no blocks before this
+} pool2_item_header;
+
+typedef struct pool2_item_footer {
+    uint64_t size : 62;
+    uint64_t last : 1; // no blocks after this
+    uint64_t : 1; // spare byte if one of the others break
+} pool2_item_footer;
+
+// Free blocks are kept in lists threaded through their payloads. The links
+// are offsets in units of 8 bytes, which lets them fit in the smallest
+// payload.
+typedef struct pool2_free_links {
+    uint32_t next;
+    uint32_t prev;
+} pool2_free_links;
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef POOL_ALLOCATOR_H_
+#define POOL_ALLOCATOR_H_
+
+// C++17 adaptors that let standard containers allocate from good_pool and
+// pool2: memory resources for std::pmr containers and Allocator templates
+// for everything else. Neither owns its pool, which has to outlive them.
+// pool2 pools and good_pool pools that aren't shared can only be used by one
+// thread at a time, containers included.
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+
+#include "good_pool.h"
+#include "pool2.h"
+
+namespace pools {
+namespace detail {
+
+// Blocks from both pools are aligned to 8 bytes, bigger alignments go
+// through the aligned allocation functions.
+constexpr std::size_t pool_alignment = 8;
+
+struct good_pool_ops {
+    using pool_type = struct good_pool;
+
+    static void *alloc(pool_type *pool, std::size_t size, std::size_t align) {
+        return align <= pool_alignment
+                ? pool_alloc(pool, size)
+                : pool_alloc_aligned(pool, size, align);
+    }
+
+    static void free(pool_type *pool, void *ptr) { pool_free(pool, ptr); }
+};
+
+struct pool2_ops {
+    using pool_type = struct pool2;
+
+    static void *alloc(pool_type *pool, std::size_t size, std::size_t align) {
+        return align <= pool_alignment
+                ? pool2_alloc(pool, size)
+                : pool2_alloc_aligned(pool, size, align);
+    }
+
+    static void free(pool_type *pool, void *ptr) { pool2_free(pool, ptr); }
+};
+
+template<typename Ops>
+class resource : public std::pmr::memory_resource {
+public:
+    using pool_type = typename Ops::pool_type;
+
+    explicit resource(pool_type *pool) noexcept : pool_{pool} {}
+
+    pool_type *pool() const noexcept { return pool_; }
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        void *ptr = Ops::alloc(pool_, bytes, align);
+        if (!ptr) throw std::bad_alloc{};
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t, std::size_t) override {
+        Ops::free(pool_, ptr);
+    }
+
+    bool do_is_equal(
+            const std::pmr::memory_resource &other) const noexcept override {
+        const auto *r = dynamic_cast<const resource *>(&other);
+        return r && r->pool_ == pool_;
+    }
+
+    pool_type *pool_;
+};
+
+template<typename T, typename Ops>
+class allocator {
+public:
+    using value_type = T;
+    using pool_type = typename Ops::pool_type;
+    // Containers that are copied, moved or swapped keep allocating from the
+    // pool they started with.
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    explicit allocator(pool_type *pool) noexcept : pool_{pool} {}
+
+    template<typename U>
+    allocator(const allocator<U, Ops> &other) noexcept
+            : pool_{other.pool()} {}
+
+    pool_type *pool() const noexcept { return pool_; }
+
+    T *allocate(std::size_t n) {
+        if (n > static_cast<std::size_t>(-1) / sizeof(T)) {
+            throw std::bad_array_new_length{};
+        }
+        void *ptr = Ops::alloc(pool_, n * sizeof(T), alignof(T));
+        if (!ptr) throw std::bad_alloc{};
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T *ptr, std::size_t) noexcept { Ops::free(pool_, ptr); }
+
+    template<typename U>
+    bool operator==(const allocator<U, Ops> &other) const noexcept {
+        return pool_ == other.pool();
+    }
+
+    template<typename U>
+    bool operator!=(const allocator<U, Ops> &other) const noexcept {
+        return pool_ != other.pool();
+    }
+
+private:
+    pool_type *pool_;
+};
+
+} // namespace detail
+
+using good_pool_resource = detail::resource<detail::good_pool_ops>;
+using pool2_resource = detail::resource<detail::pool2_ops>;
+
+template<typename T>
+using good_pool_allocator = detail::allocator<T, detail::good_pool_ops>;
+template<typename T>
+using pool2_allocator = detail::allocator<T, detail::pool2_ops>;
+
+} // namespace pools
+
+#endif
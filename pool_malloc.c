@@ -0,0 +1,434 @@
+// malloc, free and friends on top of pool2, for trying the pools out on
+// whole programs without changing them:
+//
+//   LD_PRELOAD=bazel-bin/libpool_malloc.so some_program
+//
+// Every thread allocates from a pool of its own, made with
+// pool2_create_mapped so memory is only committed as the pool fills up. A
+// thread whose pool is full lets it go and moves on to a new one. Blocks
+// freed by a thread that doesn't own their pool are pushed on a list the
+// owner frees them from the next time it allocates, or freed right away if
+// nobody owns the pool. Pools let go of, like those of threads that have
+// exited, are taken over by threads that need a pool.
+//
+// POOL_MALLOC_MIB sets how much address space every pool reserves, 4096 MiB
+// by default. Freed memory stays committed to its pool. Memory the dynamic
+// loader allocated before the library took over is never freed.
+//
+// Built with POOL_TRACING, which the Bazel target always is, setting
+// POOL_MALLOC_TRACE=file records the program's allocations and frees with
+// pool_trace. The ring buffer keeps the last POOL_MALLOC_TRACE_EVENTS
+// events, 1M by default, and is written to file.<pid> when the process
+// exits. pool_replay replays the trace against the pools and malloc, and
+// pool_trace_stats summarizes it. Build the library without --config=trace,
+// or pool2 records its own events in the same trace.
+
+#define _GNU_SOURCE // memalign, pvalloc, valloc
+
+#include "pool2.h"
+#include "pool2_format.h"
+#include "pool_trace.h"
+#include "pool_trace_hooks.h"
+
+#include <errno.h>
+#include <malloc.h> // malloc_usable_size
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h> // max_align_t
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // getpid, sysconf
+
+#define MAX_POOLS 1024
+#define DEFAULT_POOL_MIB 4096
+#define DEFAULT_TRACE_EVENTS (1 << 20)
+
+// What glibc's malloc guarantees, and what compilers assume.
+#define MALLOC_ALIGNMENT alignof(max_align_t)
+
+#define ALLOCATION_OVERHEAD \
+    (sizeof(pool2_item_header) + sizeof(pool2_item_footer))
+
+struct slot {
+    _Atomic(struct pool2 *) pool;
+    atomic_bool owned;
+    // Blocks freed by other threads, linked through their first word.
+    _Atomic(void *) remote_frees;
+};
+
+// Slots are never given back, so a pointer can always be traced to its
+// pool without taking a lock.
+static struct slot slots[MAX_POOLS];
+static atomic_size_t slot_count;
+
+// The initial-exec model never allocates, the default one can call malloc
+// the first time a thread touches the variable.
+static __thread struct slot *current
+        __attribute__((tls_model("initial-exec")));
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t exit_key;
+static size_t pool_size;
+
+static size_t slots_in_use(void) {
+    const size_t count =
+            atomic_load_explicit(&slot_count, memory_order_acquire);
+    return count < MAX_POOLS ? count : MAX_POOLS;
+}
+
+static struct pool2 *pool_of(struct slot *slot) {
+    return atomic_load_explicit(&slot->pool, memory_order_acquire);
+}
+
+static bool claim(struct slot *slot) {
+    bool owned = false;
+    return atomic_compare_exchange_strong_explicit(&slot->owned, &owned, true,
+            memory_order_acquire, memory_order_relaxed);
+}
+
+static void let_go(struct slot *slot) {
+    atomic_store_explicit(&slot->owned, false, memory_order_release);
+}
+
+// Only the owner of a slot may drain it.
+static void drain(struct slot *slot) {
+    void *ptr = atomic_exchange_explicit(
+            &slot->remote_frees, NULL, memory_order_acquire);
+    while (ptr) {
+        void *next = *(void **)ptr;
+        pool2_free(pool_of(slot), ptr);
+        ptr = next;
+    }
+}
+
+static void exit_thread(void *arg) {
+    struct slot *slot = arg;
+    drain(slot);
+    let_go(slot);
+    if (current == slot) {
+        current = NULL;
+    }
+}
+
+static void init(void) {
+    const char *mib = getenv("POOL_MALLOC_MIB");
+    const size_t n = mib ? strtoul(mib, NULL, 10) : 0;
+    pool_size = (n ? n : DEFAULT_POOL_MIB) << 20;
+    pthread_key_create(&exit_key, exit_thread);
+}
+
+#ifdef POOL_TRACING
+static const char *trace_path;
+
+static void __attribute__((constructor)) start_trace(void) {
+    trace_path = getenv("POOL_MALLOC_TRACE");
+    if (!trace_path) {
+        return;
+    }
+
+    const char *events = getenv("POOL_MALLOC_TRACE_EVENTS");
+    const size_t n = events ? strtoul(events, NULL, 10) : 0;
+    if (pool_trace_start(n ? n : DEFAULT_TRACE_EVENTS)) {
+        trace_path = NULL;
+    }
+}
+
+static void __attribute__((destructor)) write_trace(void) {
+    if (!trace_path) {
+        return;
+    }
+
+    pool_trace_stop();
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%d", trace_path, (int)getpid());
+    FILE *f = fopen(path, "w");
+    if (f) {
+        pool_trace_write(f);
+        fclose(f);
+    }
+}
+#endif
+
+static struct slot *new_slot(size_t size) {
+    struct pool2 *pool = pool2_create_mapped(size, 0);
+    if (!pool) {
+        return NULL;
+    }
+
+    // Pools hand out payloads 8 bytes off a 16-byte boundary. One block
+    // that's never freed shifts every block after it onto the boundary.
+    void *pad = pool2_alloc(pool, 0);
+    if ((uintptr_t)pad % MALLOC_ALIGNMENT == 0) {
+        pool2_free(pool, pad);
+    }
+
+    const size_t n = atomic_fetch_add(&slot_count, 1);
+    if (n >= MAX_POOLS) {
+        pool2_destroy(pool);
+        return NULL;
+    }
+
+    // Nobody can claim the slot before it has a pool.
+    atomic_store_explicit(&slots[n].owned, true, memory_order_relaxed);
+    atomic_store_explicit(&slots[n].pool, pool, memory_order_release);
+    return &slots[n];
+}
+
+static void set_current(struct slot *slot) {
+    current = slot;
+    pthread_setspecific(exit_key, slot);
+}
+
+// Takes over a pool nobody owns, or makes a new one.
+static struct slot *find_pool(void) {
+    pthread_once(&once, init);
+
+    const size_t count = slots_in_use();
+    for (size_t n = 0; n < count; ++n) {
+        if (pool_of(&slots[n]) && claim(&slots[n])) {
+            drain(&slots[n]);
+            return &slots[n];
+        }
+    }
+
+    return new_slot(pool_size);
+}
+
+static void *pool_alloc_in(struct slot *slot, size_t size, size_t align) {
+    if (atomic_load_explicit(&slot->remote_frees, memory_order_relaxed)) {
+        drain(slot);
+    }
+
+    struct pool2 *pool = pool_of(slot);
+    if (align > MALLOC_ALIGNMENT) {
+        return pool2_alloc_aligned(pool, size, align);
+    }
+
+    // Blocks that are multiples of 16 bytes keep the next block aligned.
+    const size_t rounded = size < MALLOC_ALIGNMENT
+            ? MALLOC_ALIGNMENT
+            : (size + MALLOC_ALIGNMENT - 1) & ~(MALLOC_ALIGNMENT - 1);
+    void *ptr = pool2_alloc(pool, rounded);
+    if (!ptr || (uintptr_t)ptr % MALLOC_ALIGNMENT == 0) {
+        return ptr;
+    }
+
+    // Blocks after memory the pool just committed can still be off.
+    pool2_free(pool, ptr);
+    return pool2_alloc_aligned(pool, size, MALLOC_ALIGNMENT);
+}
+
+static void *allocate(size_t size, size_t align) {
+    if (size > SIZE_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (!current) {
+        struct slot *slot = find_pool();
+        if (!slot) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        set_current(slot);
+    }
+
+    void *ptr = pool_alloc_in(current, size, align);
+    if (ptr) {
+        return ptr;
+    }
+
+    // The pool is full. A new one is made big enough for the allocation.
+    const size_t needed = size + align + MALLOC_ALIGNMENT + 64;
+    struct slot *slot = new_slot(needed > pool_size ? needed : pool_size);
+    if (!slot) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    let_go(current);
+    set_current(slot);
+
+    ptr = pool_alloc_in(slot, size, align);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+static struct slot *slot_of(const void *ptr) {
+    if (current && pool2_owns(pool_of(current), ptr)) {
+        return current;
+    }
+
+    const size_t count = slots_in_use();
+    for (size_t n = 0; n < count; ++n) {
+        const struct pool2 *pool = pool_of(&slots[n]);
+        if (pool && pool2_owns(pool, ptr)) {
+            return &slots[n];
+        }
+    }
+    return NULL;
+}
+
+static size_t usable_size(const void *ptr) {
+    return ((const pool2_item_header *)ptr - 1)->size - ALLOCATION_OVERHEAD;
+}
+
+static void free_in(struct slot *slot, void *ptr) {
+    if (slot == current) {
+        pool2_free(pool_of(slot), ptr);
+        return;
+    }
+    if (claim(slot)) {
+        pool2_free(pool_of(slot), ptr);
+        drain(slot);
+        let_go(slot);
+        return;
+    }
+
+    void *head = atomic_load_explicit(&slot->remote_frees,
+            memory_order_relaxed);
+    do {
+        *(void **)ptr = head;
+    } while (!atomic_compare_exchange_weak_explicit(&slot->remote_frees,
+            &head, ptr, memory_order_release, memory_order_relaxed));
+}
+
+static void *resize(struct slot *slot, void *ptr, size_t size) {
+    if (slot == current && size <= SIZE_MAX / 2) {
+        const size_t rounded = (size + MALLOC_ALIGNMENT - 1)
+                & ~(MALLOC_ALIGNMENT - 1);
+        void *moved = pool2_realloc(pool_of(slot), ptr, rounded);
+        if (moved && (uintptr_t)moved % MALLOC_ALIGNMENT == 0) {
+            return moved;
+        }
+        // pool2_realloc doesn't keep blocks it moves aligned, so those are
+        // moved once more.
+        if (moved) {
+            ptr = moved;
+        }
+    }
+
+    void *moved = allocate(size, 0);
+    if (!moved) {
+        return NULL;
+    }
+    const size_t old_size = usable_size(ptr);
+    memcpy(moved, ptr, old_size < size ? old_size : size);
+    free_in(slot, ptr);
+    return moved;
+}
+
+static void *allocate_aligned(size_t align, size_t size) {
+    if (!align || align & (align - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return allocate(size, align);
+}
+
+// Every call is traced where the program made it.
+
+void *malloc(size_t size) {
+    void *ptr = allocate(size, 0);
+    TRACE_ALLOC(NULL, ptr, size);
+    return ptr;
+}
+
+void free(void *ptr) {
+    struct slot *slot = ptr ? slot_of(ptr) : NULL;
+    if (slot) {
+        TRACE_FREE(NULL, ptr);
+        free_in(slot, ptr);
+    }
+}
+
+void *calloc(size_t n, size_t size) {
+    if (size && n > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *ptr = allocate(n * size, 0);
+    if (ptr) {
+        memset(ptr, 0, n * size);
+    }
+    TRACE_ALLOC(NULL, ptr, n * size);
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (!ptr) {
+        ptr = allocate(size, 0);
+        TRACE_ALLOC(NULL, ptr, size);
+        return ptr;
+    }
+
+    struct slot *slot = slot_of(ptr);
+    if (!slot) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    TRACE_FREE(NULL, ptr);
+    if (!size) {
+        free_in(slot, ptr);
+        return NULL;
+    }
+
+    void *moved = resize(slot, ptr, size);
+    // A block that couldn't be resized is still there.
+    TRACE_ALLOC(NULL, moved ? moved : ptr, moved ? size : usable_size(ptr));
+    return moved;
+}
+
+int posix_memalign(void **out, size_t align, size_t size) {
+    if (align < sizeof(void *) || align & (align - 1)) {
+        return EINVAL;
+    }
+
+    void *ptr = allocate(size, align);
+    if (!ptr) {
+        return ENOMEM;
+    }
+    TRACE_ALLOC(NULL, ptr, size);
+    *out = ptr;
+    return 0;
+}
+
+// The rest of glibc's allocation functions, so that nothing a program
+// frees comes from glibc's malloc.
+
+void *aligned_alloc(size_t align, size_t size) {
+    void *ptr = allocate_aligned(align, size);
+    TRACE_ALLOC(NULL, ptr, size);
+    return ptr;
+}
+
+void *memalign(size_t align, size_t size) {
+    void *ptr = allocate_aligned(align, size);
+    TRACE_ALLOC(NULL, ptr, size);
+    return ptr;
+}
+
+void *valloc(size_t size) {
+    void *ptr = allocate(size, sysconf(_SC_PAGESIZE));
+    TRACE_ALLOC(NULL, ptr, size);
+    return ptr;
+}
+
+void *pvalloc(size_t size) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    void *ptr = allocate((size + page_size - 1) / page_size * page_size,
+            page_size);
+    TRACE_ALLOC(NULL, ptr, size);
+    return ptr;
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return ptr && slot_of(ptr) ? usable_size(ptr) : 0;
+}
@@ -0,0 +1,541 @@
+// Replays a trace written by pool_trace_write against good_pool, pool2 and
+// malloc, to judge the allocators on a real workload.
+//
+//   pool_replay [-a allocator] [-p pool size] [-r runs] [-s samples] [trace]
+//
+// Programs are recorded with libpool_malloc.so and POOL_MALLOC_TRACE, the
+// pools themselves with --config=trace. Every allocation in the trace is
+// matched to the free of the same pointer, then the events of all threads
+// are replayed in the order they were recorded, on one thread, so every run
+// does the same work. Frees of memory allocated before the trace started are
+// skipped. Every -a adds an allocator, good_pool, pool2 or malloc, and all of
+// them are replayed if none is given. Pools start at -p bytes, 64 KiB by
+// default, and double as they run out.
+//
+// The first run times every allocation and free, and samples the
+// allocator's footprint -s times, 20 by default, and once more where the
+// most memory is live. Throughput is the best of -r more runs, 3 by
+// default, that don't time single events. Footprint is what the allocator
+// holds on to: the arenas of a pool, or the heap and mapped chunks of
+// malloc. Fragmentation is the part of the footprint that isn't live, so it
+// counts block headers and rounding as well as free memory. The trace is
+// read from stdin if no file is given.
+
+#define _GNU_SOURCE // mallinfo2
+
+#include <malloc.h> // mallinfo2, malloc_trim
+#include <stdbool.h>
+#include <stdint.h> // uint32_t, uint64_t, UINT32_MAX
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // strcmp
+#include <time.h> // clock_gettime
+#include <unistd.h> // getopt
+
+#include "good_pool.h"
+#include "pool2.h"
+#include "pool_trace.h"
+
+#define DEFAULT_POOL_SIZE (64 << 10)
+#define DEFAULT_RUNS 3
+#define DEFAULT_SAMPLES 20
+
+// An event of the trace, with its pointer replaced by the index of a slot
+// that holds the block while it's live.
+struct op {
+    uint64_t size; // 0 for frees
+    uint32_t slot;
+    uint32_t kind;
+};
+
+struct replay {
+    struct op *ops;
+    size_t count;
+    // The size of the allocation that fills every slot.
+    uint64_t *sizes;
+    size_t slots;
+    // Slots whose block is never freed.
+    uint32_t *unfreed;
+    size_t unfreed_count;
+    size_t allocs;
+    size_t threads;
+    // Frees of memory allocated before the trace started.
+    size_t skipped;
+    // The op after which the most memory is live.
+    size_t peak_op;
+    uint64_t peak_live;
+};
+
+struct allocator {
+    const char *name;
+    void *(*create)(size_t pool_size);
+    void (*destroy)(void *a);
+    void *(*alloc)(void *a, size_t size);
+    void (*free)(void *a, void *ptr);
+    size_t (*footprint)(void *a);
+};
+
+static void *good_pool_create(size_t pool_size) {
+    struct good_pool *pool = pool_create(pool_size);
+    if (pool) pool_set_growth(pool, POOL_GROW_DOUBLE, 0);
+    return pool;
+}
+
+static void good_pool_destroy(void *a) {
+    pool_destroy(a);
+}
+
+static void *good_pool_alloc(void *a, size_t size) {
+    return pool_alloc(a, size);
+}
+
+static void good_pool_free(void *a, void *ptr) {
+    pool_free(a, ptr);
+}
+
+static size_t good_pool_footprint(void *a) {
+    return pool_available(a) + pool_allocated(a);
+}
+
+static void *pool2_create_growing(size_t pool_size) {
+    struct pool2 *pool = pool2_create(pool_size);
+    if (pool) pool2_set_growth(pool, POOL2_GROW_DOUBLE, 0);
+    return pool;
+}
+
+static void pool2_destroy_pool(void *a) {
+    pool2_destroy(a);
+}
+
+static void *pool2_alloc_block(void *a, size_t size) {
+    return pool2_alloc(a, size);
+}
+
+static void pool2_free_block(void *a, void *ptr) {
+    pool2_free(a, ptr);
+}
+
+static size_t pool2_footprint(void *a) {
+    return pool2_available(a) + pool2_allocated(a);
+}
+
+// malloc is shared with everything else in the process, so its footprint
+// is counted from what it held when the replay started, after giving back
+// what it could.
+static size_t malloc_baseline;
+
+static size_t malloc_held(void) {
+    const struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+
+static void *malloc_create(size_t pool_size) {
+    (void)pool_size;
+    malloc_trim(0);
+    malloc_baseline = malloc_held();
+    return &malloc_baseline;
+}
+
+static void malloc_destroy(void *a) {
+    (void)a;
+}
+
+static void *malloc_alloc(void *a, size_t size) {
+    (void)a;
+    return malloc(size);
+}
+
+static void malloc_free(void *a, void *ptr) {
+    (void)a;
+    free(ptr);
+}
+
+static size_t malloc_footprint(void *a) {
+    (void)a;
+    const size_t held = malloc_held();
+    return held > malloc_baseline ? held - malloc_baseline : 0;
+}
+
+static const struct allocator allocators[] = {
+    {"good_pool", good_pool_create, good_pool_destroy, good_pool_alloc,
+            good_pool_free, good_pool_footprint},
+    {"pool2", pool2_create_growing, pool2_destroy_pool, pool2_alloc_block,
+            pool2_free_block, pool2_footprint},
+    {"malloc", malloc_create, malloc_destroy, malloc_alloc, malloc_free,
+            malloc_footprint},
+};
+
+#define ALLOCATOR_COUNT (sizeof(allocators) / sizeof(allocators[0]))
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Events sorted by pointer, see pool_trace_stats.
+struct key {
+    uint64_t pool;
+    uint64_t ptr;
+    size_t n;
+};
+
+static int by_pointer(const void *a, const void *b) {
+    const struct key *x = a;
+    const struct key *y = b;
+    if (x->pool != y->pool) return (x->pool > y->pool) - (x->pool < y->pool);
+    if (x->ptr != y->ptr) return (x->ptr > y->ptr) - (x->ptr < y->ptr);
+    return (x->n > y->n) - (x->n < y->n);
+}
+
+static int by_value(const void *a, const void *b) {
+    const uint32_t x = *(const uint32_t *)a;
+    const uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int prepare(
+        const struct pool_trace_event *events,
+        size_t count,
+        struct replay *r) {
+    struct key *keys = malloc(count * sizeof(*keys) + 1);
+    uint32_t *slots = malloc(count * sizeof(*slots) + 1);
+    r->ops = malloc(count * sizeof(*r->ops) + 1);
+    r->sizes = malloc(count * sizeof(*r->sizes) + 1);
+    r->unfreed = malloc(count * sizeof(*r->unfreed) + 1);
+    if (!keys || !slots || !r->ops || !r->sizes || !r->unfreed
+            || count >= UINT32_MAX) {
+        free(keys);
+        free(slots);
+        return -1;
+    }
+
+    // Once the events of every pointer are together and in order, each free
+    // follows the allocation it ends. UINT32_MAX marks frees without one.
+    for (size_t n = 0; n < count; ++n) {
+        keys[n] = (struct key){events[n].pool, events[n].ptr, n};
+    }
+    qsort(keys, count, sizeof(*keys), by_pointer);
+    for (size_t n = 0; n < count; ++n) {
+        const struct pool_trace_event *e = &events[keys[n].n];
+        if (e->kind != POOL_TRACE_ALLOC) {
+            slots[keys[n].n] = UINT32_MAX;
+            continue;
+        }
+
+        r->sizes[r->slots] = e->size;
+        slots[keys[n].n] = r->slots;
+        const struct key *next = n + 1 < count ? &keys[n + 1] : NULL;
+        if (next && next->pool == keys[n].pool && next->ptr == keys[n].ptr
+                && events[next->n].kind == POOL_TRACE_FREE) {
+            slots[next->n] = r->slots;
+            ++n;
+        } else {
+            r->unfreed[r->unfreed_count++] = r->slots;
+        }
+        ++r->slots;
+    }
+
+    uint64_t live = 0;
+    for (size_t n = 0; n < count; ++n) {
+        const struct pool_trace_event *e = &events[n];
+        if (slots[n] == UINT32_MAX) {
+            ++r->skipped;
+            continue;
+        }
+
+        const bool alloc = e->kind == POOL_TRACE_ALLOC;
+        r->ops[r->count++] = (struct op){
+            .size = alloc ? e->size : 0,
+            .slot = slots[n],
+            .kind = e->kind,
+        };
+        if (alloc) {
+            ++r->allocs;
+            live += e->size;
+            if (live > r->peak_live) {
+                r->peak_live = live;
+                r->peak_op = r->count - 1;
+            }
+        } else {
+            live -= r->sizes[slots[n]];
+        }
+    }
+    // Threads are numbered in the order they started recording, so the
+    // ones seen are counted by sorting.
+    for (size_t n = 0; n < count; ++n) {
+        slots[n] = events[n].thread;
+    }
+    qsort(slots, count, sizeof(*slots), by_value);
+    for (size_t n = 0; n < count; ++n) {
+        if (!n || slots[n] != slots[n - 1]) ++r->threads;
+    }
+
+    free(keys);
+    free(slots);
+    return 0;
+}
+
+// Frees what the trace leaves live, so nothing leaks from run to run.
+static void free_unfreed(
+        const struct allocator *a,
+        void *state,
+        const struct replay *r,
+        void **blocks) {
+    for (size_t n = 0; n < r->unfreed_count; ++n) {
+        if (blocks[r->unfreed[n]]) {
+            a->free(state, blocks[r->unfreed[n]]);
+        }
+    }
+}
+
+static size_t replay_once(
+        const struct allocator *a,
+        void *state,
+        const struct replay *r,
+        void **blocks) {
+    size_t failures = 0;
+    for (size_t n = 0; n < r->count; ++n) {
+        const struct op *op = &r->ops[n];
+        if (op->kind == POOL_TRACE_ALLOC) {
+            blocks[op->slot] = a->alloc(state, op->size);
+            if (!blocks[op->slot]) ++failures;
+        } else if (blocks[op->slot]) {
+            a->free(state, blocks[op->slot]);
+        }
+    }
+    return failures;
+}
+
+struct sample {
+    size_t op;
+    uint64_t live;
+    size_t footprint;
+};
+
+struct timing {
+    uint32_t *alloc_ns;
+    uint32_t *free_ns;
+    size_t allocs;
+    size_t frees;
+    struct sample *samples;
+    size_t sample_count;
+};
+
+static uint32_t elapsed(uint64_t start, uint64_t end) {
+    return end - start < UINT32_MAX ? end - start : UINT32_MAX;
+}
+
+// Like replay_once, but every event is timed and footprint is sampled
+// between them.
+static void replay_timed(
+        const struct allocator *a,
+        void *state,
+        const struct replay *r,
+        void **blocks,
+        size_t interval,
+        struct timing *t) {
+    uint64_t live = 0;
+    for (size_t n = 0; n < r->count; ++n) {
+        const struct op *op = &r->ops[n];
+        if (op->kind == POOL_TRACE_ALLOC) {
+            const uint64_t start = now();
+            blocks[op->slot] = a->alloc(state, op->size);
+            t->alloc_ns[t->allocs++] = elapsed(start, now());
+            if (blocks[op->slot]) live += op->size;
+        } else if (blocks[op->slot]) {
+            const uint64_t start = now();
+            a->free(state, blocks[op->slot]);
+            t->free_ns[t->frees++] = elapsed(start, now());
+            live -= r->sizes[op->slot];
+        }
+
+        if ((n + 1) % interval == 0 || n + 1 == r->count || n == r->peak_op) {
+            t->samples[t->sample_count++] =
+                    (struct sample){n + 1, live, a->footprint(state)};
+        }
+    }
+}
+
+static void print_latency(const char *title, uint32_t *ns, size_t count) {
+    if (!count) return;
+
+    qsort(ns, count, sizeof(*ns), by_value);
+    printf("  %s latency in ns: p50 %u, p99 %u, p99.9 %u, max %u\n", title,
+            ns[count / 2], ns[count * 99 / 100], ns[count * 999 / 1000],
+            ns[count - 1]);
+}
+
+static int run(
+        const struct allocator *a,
+        const struct replay *r,
+        size_t pool_size,
+        size_t runs,
+        size_t samples) {
+    void **blocks = calloc(r->slots + 1, sizeof(*blocks));
+    const size_t interval = r->count / samples ? r->count / samples : 1;
+    struct timing t = {
+        .alloc_ns = malloc(r->allocs * sizeof(*t.alloc_ns) + 1),
+        .free_ns = malloc((r->count - r->allocs) * sizeof(*t.free_ns) + 1),
+        .samples = malloc((r->count / interval + 2) * sizeof(*t.samples)),
+    };
+    if (!blocks || !t.alloc_ns || !t.free_ns || !t.samples) {
+        free(blocks);
+        free(t.alloc_ns);
+        free(t.free_ns);
+        free(t.samples);
+        return -1;
+    }
+
+    void *state = a->create(pool_size);
+    if (!state) goto fail;
+    replay_timed(a, state, r, blocks, interval, &t);
+    free_unfreed(a, state, r, blocks);
+    a->destroy(state);
+
+    uint64_t best = UINT64_MAX;
+    size_t failures = 0;
+    for (size_t n = 0; n < runs; ++n) {
+        state = a->create(pool_size);
+        if (!state) goto fail;
+        const uint64_t start = now();
+        failures = replay_once(a, state, r, blocks);
+        const uint64_t ns = now() - start;
+        if (ns < best) best = ns;
+        free_unfreed(a, state, r, blocks);
+        a->destroy(state);
+    }
+
+    printf("%s:\n", a->name);
+    printf("  throughput: %.2f M events/s, %zu failed allocations\n",
+            best ? r->count * 1000.0 / best : 0.0, failures);
+    print_latency("alloc", t.alloc_ns, t.allocs);
+    print_latency("free", t.free_ns, t.frees);
+
+    size_t peak = 0;
+    uint64_t peak_live = 0;
+    for (size_t n = 0; n < t.sample_count; ++n) {
+        if (t.samples[n].footprint > peak) {
+            peak = t.samples[n].footprint;
+            peak_live = t.samples[n].live;
+        }
+    }
+    printf("  peak footprint: %zu bytes with %llu bytes live\n", peak,
+            (unsigned long long)peak_live);
+
+    printf("  %12s %14s %14s %14s\n", "events", "live", "footprint",
+            "fragmentation");
+    for (size_t n = 0; n < t.sample_count; ++n) {
+        const struct sample *s = &t.samples[n];
+        printf("  %12zu %14llu %14zu %13.1f%%\n", s->op,
+                (unsigned long long)s->live, s->footprint,
+                s->footprint > s->live
+                        ? 100.0 * (1.0 - (double)s->live / s->footprint)
+                        : 0.0);
+    }
+
+    free(blocks);
+    free(t.alloc_ns);
+    free(t.free_ns);
+    free(t.samples);
+    return 0;
+
+fail:
+    free(blocks);
+    free(t.alloc_ns);
+    free(t.free_ns);
+    free(t.samples);
+    return -1;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-a good_pool|pool2|malloc] [-p pool size] "
+            "[-r runs] [-s samples] [trace]\n", name);
+}
+
+int main(int argc, char **argv) {
+    bool chosen[ALLOCATOR_COUNT] = {false};
+    bool any_chosen = false;
+    size_t pool_size = DEFAULT_POOL_SIZE;
+    size_t runs = DEFAULT_RUNS;
+    size_t samples = DEFAULT_SAMPLES;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:r:s:")) != -1) {
+        size_t n = 0;
+        switch (opt) {
+        case 'a':
+            while (n < ALLOCATOR_COUNT && strcmp(optarg, allocators[n].name)) {
+                ++n;
+            }
+            if (n == ALLOCATOR_COUNT) {
+                usage(argv[0]);
+                return 2;
+            }
+            chosen[n] = any_chosen = true;
+            break;
+        case 'p':
+            pool_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            runs = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            samples = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!runs || !samples || optind + 1 < argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    FILE *f = optind < argc ? fopen(argv[optind], "rb") : stdin;
+    if (!f) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    struct pool_trace_header header;
+    struct pool_trace_event *events;
+    const int error = pool_trace_read(f, &header, &events);
+    if (f != stdin) fclose(f);
+    if (error) {
+        fprintf(stderr, "%s: couldn't read the trace\n", argv[0]);
+        free(events);
+        return 1;
+    }
+
+    struct replay r = {0};
+    if (prepare(events, header.count, &r)) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+    free(events);
+
+    printf("events: %zu, allocations: %zu, frees: %zu, threads: %zu, "
+            "dropped: %llu\n", r.count, r.allocs, r.count - r.allocs,
+            r.threads, (unsigned long long)header.dropped);
+    printf("skipped frees of memory allocated before the trace: %zu\n",
+            r.skipped);
+    printf("most memory live: %llu bytes\n\n",
+            (unsigned long long)r.peak_live);
+
+    for (size_t n = 0; n < ALLOCATOR_COUNT; ++n) {
+        if (any_chosen && !chosen[n]) continue;
+        if (run(&allocators[n], &r, pool_size, runs, samples)) {
+            fprintf(stderr, "%s: couldn't replay on %s\n", argv[0],
+                    allocators[n].name);
+            return 1;
+        }
+        printf("\n");
+    }
+
+    free(r.ops);
+    free(r.sizes);
+    free(r.unfreed);
+    return 0;
+}
@@ -0,0 +1,41 @@
+#include "pool_snapshot.h"
+
+#include <stdbool.h> // bool, true, false
+
+struct snapshot_writer {
+    FILE *f;
+    bool failed;
+};
+
+static void write_block(
+        struct snapshot_writer *w,
+        unsigned arena,
+        size_t offset,
+        size_t size,
+        int in_use) {
+    if (w->failed) return;
+
+    if (fprintf(w->f, "%u %zu %zu %d\n", arena, offset, size, !!in_use) < 0) {
+        w->failed = true;
+    }
+}
+
+static void write_pool_block(void *arg, const struct pool_block *block) {
+    write_block(arg, block->arena, block->offset, block->sz, block->in_use);
+}
+
+static void write_pool2_block(void *arg, const struct pool2_block *block) {
+    write_block(arg, block->arena, block->offset, block->size, block->in_use);
+}
+
+int pool_write_snapshot(const struct good_pool *pool, FILE *f) {
+    struct snapshot_writer w = {f, false};
+    pool_walk(pool, write_pool_block, &w);
+    return w.failed || fflush(f) ? -1 : 0;
+}
+
+int pool2_write_snapshot(const struct pool2 *pool, FILE *f) {
+    struct snapshot_writer w = {f, false};
+    pool2_walk(pool, write_pool2_block, &w);
+    return w.failed || fflush(f) ? -1 : 0;
+}
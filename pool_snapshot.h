@@ -0,0 +1,25 @@
+#ifndef POOL_SNAPSHOT_H_
+#define POOL_SNAPSHOT_H_
+
+#include <stdio.h> // FILE
+
+#include "good_pool.h"
+#include "pool2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Snapshots list every block of a pool, one per line: the arena, the block's
+// offset in it, its size and 1 if it's in use or 0 if it's free. heap_map
+// reads them and prints the pool's layout.
+//
+// Both return 0, or -1 if writing to f fails.
+int pool_write_snapshot(const struct good_pool *pool, FILE *f);
+int pool2_write_snapshot(const struct pool2 *pool, FILE *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,184 @@
+#include "pool_trace.h"
+
+#include <stdalign.h> // alignas
+#include <stdatomic.h>
+#include <stdbool.h> // bool, true, false
+#include <stdint.h> // uint64_t, uintptr_t
+#include <stdlib.h>
+#include <string.h> // memcmp, memcpy, memset
+#include <time.h> // clock_gettime
+
+// Events go into a ring buffer without locks. A writer claims the next
+// sequence number and fills the slot it maps to. Every slot carries the
+// sequence number of the event in it plus one, cleared while the slot is
+// being written, so a reader skips slots that were never finished. Two
+// writers a whole ring apart can still fill the same slot at once and mix
+// their events. Checking the event's own sequence number catches some of
+// that, not all of it.
+struct trace_slot {
+    atomic_uint_fast64_t seq;
+    struct pool_trace_event event;
+};
+
+struct trace_ring {
+    atomic_uint_fast64_t head;
+    uint64_t mask;
+    struct trace_slot slots[];
+};
+
+atomic_bool pool_trace_on;
+
+#define CACHE_LINE_SIZE 64
+#define WRITER_STRIPES 64
+
+static struct trace_ring *_Atomic running;
+// Threads that might still hold a pointer to the running ring, counted on
+// their own cache lines so writers on different threads rarely share one.
+static struct {
+    alignas(CACHE_LINE_SIZE) atomic_size_t count;
+} writers[WRITER_STRIPES];
+// The last ring that was stopped, kept around to be written.
+static struct trace_ring *stopped;
+
+int pool_trace_start(size_t capacity) {
+    if (atomic_load(&running)) return -1;
+
+    size_t slots = 1;
+    while (slots < capacity) {
+        if (slots > SIZE_MAX / 2 / sizeof(struct trace_slot)) return -1;
+        slots *= 2;
+    }
+
+    struct trace_ring *r =
+            calloc(1, sizeof(*r) + slots * sizeof(struct trace_slot));
+    if (!r) return -1;
+    r->mask = slots - 1;
+
+    free(stopped);
+    stopped = NULL;
+    atomic_store(&running, r);
+    atomic_store(&pool_trace_on, true);
+    return 0;
+}
+
+void pool_trace_stop(void) {
+    struct trace_ring *r = atomic_exchange(&running, NULL);
+    if (!r) return;
+
+    atomic_store(&pool_trace_on, false);
+    for (size_t n = 0; n < WRITER_STRIPES; ++n) {
+        while (atomic_load(&writers[n].count)) {
+        }
+    }
+    stopped = r;
+}
+
+static atomic_uint threads;
+static __thread uint32_t thread;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void pool_trace_record(
+        enum pool_trace_kind kind,
+        const void *pool,
+        const void *ptr,
+        size_t size,
+        const void *caller) {
+    if (!ptr) return;
+
+    if (!thread) {
+        thread = atomic_fetch_add_explicit(&threads, 1, memory_order_relaxed)
+                + 1;
+    }
+    // Counted before running is loaded, so pool_trace_stop either sees the
+    // count or this thread sees the ring is gone.
+    atomic_size_t *count = &writers[thread % WRITER_STRIPES].count;
+    atomic_fetch_add(count, 1);
+    struct trace_ring *r = atomic_load(&running);
+    if (r) {
+        const uint64_t seq = atomic_fetch_add_explicit(
+                &r->head, 1, memory_order_relaxed);
+        struct trace_slot *s = &r->slots[seq & r->mask];
+
+        atomic_store_explicit(&s->seq, 0, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        s->event = (struct pool_trace_event){
+            .seq = seq,
+            .time = now(),
+            .pool = (uintptr_t)pool,
+            .ptr = (uintptr_t)ptr,
+            .caller = (uintptr_t)caller,
+            .size = size,
+            .kind = kind,
+            .thread = thread,
+        };
+        atomic_store_explicit(&s->seq, seq + 1, memory_order_release);
+    }
+    atomic_fetch_sub(count, 1);
+}
+
+static bool whole(const struct trace_slot *s, uint64_t seq) {
+    return atomic_load(&s->seq) == seq + 1
+            && s->event.seq == seq;
+}
+
+int pool_trace_write(FILE *f) {
+    const struct trace_ring *r = stopped;
+    if (!r) return -1;
+
+    const uint64_t head = atomic_load(&r->head);
+    const uint64_t first = head > r->mask ? head - r->mask - 1 : 0;
+
+    // Events that were overwritten by a writer lapping another one are
+    // dropped too, so the count is only known once they've all been looked
+    // at.
+    struct pool_trace_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, POOL_TRACE_MAGIC, sizeof(POOL_TRACE_MAGIC));
+    h.version = POOL_TRACE_VERSION;
+    h.event_size = sizeof(struct pool_trace_event);
+    h.dropped = first;
+    for (uint64_t seq = first; seq < head; ++seq) {
+        if (whole(&r->slots[seq & r->mask], seq)) {
+            ++h.count;
+        } else {
+            ++h.dropped;
+        }
+    }
+
+    bool failed = fwrite(&h, sizeof(h), 1, f) != 1;
+    for (uint64_t seq = first; seq < head && !failed; ++seq) {
+        const struct trace_slot *s = &r->slots[seq & r->mask];
+        if (whole(s, seq)) {
+            failed = fwrite(&s->event, sizeof(s->event), 1, f) != 1;
+        }
+    }
+
+    return failed || fflush(f) ? -1 : 0;
+}
+
+int pool_trace_read(
+        FILE *f,
+        struct pool_trace_header *header,
+        struct pool_trace_event **events) {
+    *events = NULL;
+    if (fread(header, sizeof(*header), 1, f) != 1
+            || memcmp(header->magic, POOL_TRACE_MAGIC,
+                    sizeof(POOL_TRACE_MAGIC))
+            || header->version != POOL_TRACE_VERSION
+            || header->event_size != sizeof(struct pool_trace_event)
+            || header->count > SIZE_MAX / sizeof(struct pool_trace_event)) {
+        return -1;
+    }
+
+    *events = malloc(header->count * sizeof(**events) + 1);
+    if (!*events) return -1;
+    return fread(*events, sizeof(**events), header->count, f)
+            == header->count
+            ? 0
+            : -1;
+}
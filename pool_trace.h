@@ -0,0 +1,79 @@
+#ifndef POOL_TRACE_H_
+#define POOL_TRACE_H_
+
+#include <stdint.h> // uint32_t, uint64_t
+#include <stdio.h> // FILE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// good_pool and pool2 report their allocations and frees here when they're
+// built with POOL_TRACING (bazel build --config=trace). Tracing is off until
+// pool_trace_start is called and costs a load and a branch per call then.
+// pool_trace_stats turns a written trace into size, lifetime and call site
+// histograms.
+
+enum pool_trace_kind {
+    POOL_TRACE_ALLOC,
+    POOL_TRACE_FREE,
+};
+
+struct pool_trace_event {
+    // Orders the events of all threads.
+    uint64_t seq;
+    // Nanoseconds on the monotonic clock.
+    uint64_t time;
+    uint64_t pool;
+    uint64_t ptr;
+    // The return address of the pool function that was called.
+    uint64_t caller;
+    // The size that was asked for. 0 for frees.
+    uint64_t size;
+    uint32_t kind;
+    // Threads are numbered from 1 in the order they first record an event.
+    uint32_t thread;
+};
+
+// Traces are written as this header followed by count events.
+#define POOL_TRACE_MAGIC "POOLTRC"
+#define POOL_TRACE_VERSION 1
+
+struct pool_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;
+    uint64_t count;
+    // Events that were overwritten because the ring buffer was full.
+    uint64_t dropped;
+};
+
+// Starts recording into a ring buffer that keeps the last capacity events,
+// rounded up to a power of two. Returns -1 if tracing is already running or
+// there's no memory for the buffer.
+int pool_trace_start(size_t capacity);
+// Stops recording and waits for threads that are still writing an event.
+void pool_trace_stop(void);
+// Writes what the last stopped trace recorded. Returns 0, or -1 if there's
+// no trace or writing to f fails.
+int pool_trace_write(FILE *f);
+// Reads a trace written by pool_trace_write. *events gets header->count
+// events and has to be freed, even if reading fails. Returns 0, or -1 if f
+// doesn't hold a trace or reading it fails.
+int pool_trace_read(
+        FILE *f,
+        struct pool_trace_header *header,
+        struct pool_trace_event **events);
+
+void pool_trace_record(
+        enum pool_trace_kind kind,
+        const void *pool,
+        const void *ptr,
+        size_t size,
+        const void *caller);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef POOL_TRACE_HOOKS_H_
+#define POOL_TRACE_HOOKS_H_
+
+// Used by the pools to call into pool_trace. Without POOL_TRACING the hooks
+// compile to nothing.
+
+#ifdef POOL_TRACING
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "pool_trace.h"
+
+extern atomic_bool pool_trace_on;
+
+// Has to be expanded in the function whose caller should be recorded.
+#define TRACE(kind, pool, ptr, size) \
+    do { \
+        if (__builtin_expect( \
+                atomic_load_explicit(&pool_trace_on, memory_order_relaxed), \
+                0)) { \
+            pool_trace_record((kind), (pool), (ptr), (size), \
+                    __builtin_return_address(0)); \
+        } \
+    } while (0)
+
+#define TRACE_ALLOC(pool, ptr, size) TRACE(POOL_TRACE_ALLOC, pool, ptr, size)
+#define TRACE_FREE(pool, ptr) TRACE(POOL_TRACE_FREE, pool, ptr, 0)
+
+#else
+
+#define TRACE_ALLOC(pool, ptr, size) ((void)0)
+#define TRACE_FREE(pool, ptr) ((void)0)
+
+#endif
+
+#endif
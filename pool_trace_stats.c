@@ -0,0 +1,200 @@
+// Prints what a trace written by pool_trace_write says about the sizes,
+// lifetimes and call sites of allocations.
+//
+//   pool_trace_stats [-n top entries] [trace]
+//
+// Sizes are the ones asked for, so the most common ones are candidates for
+// size classes. Lifetimes are measured from an allocation to the free of the
+// same pointer in the same pool, both in nanoseconds and in the number of
+// events in between. Call sites are return addresses, addr2line turns them
+// into source lines as long as the program isn't position independent.
+// The trace is read from stdin if no file is given.
+
+#include <stdint.h> // uint64_t
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h> // getopt
+
+#include "pool_trace.h"
+
+#define HISTOGRAM_BUCKETS 64
+
+struct trace {
+    struct pool_trace_header header;
+    struct pool_trace_event *events;
+};
+
+// Sizes or call sites with how often they came up.
+struct tally {
+    uint64_t key;
+    uint64_t count;
+    uint64_t bytes;
+};
+
+static unsigned bucket(uint64_t n) {
+    return n ? 63 - __builtin_clzll(n) : 0;
+}
+
+static void print_histogram(const char *title, const uint64_t *histogram) {
+    printf("%s:\n", title);
+    for (size_t n = 0; n < HISTOGRAM_BUCKETS; ++n) {
+        if (histogram[n]) {
+            printf("  %20llu+ %llu\n", 1ull << n,
+                    (unsigned long long)histogram[n]);
+        }
+    }
+}
+
+static int by_key(const void *a, const void *b) {
+    const uint64_t x = ((const struct tally *)a)->key;
+    const uint64_t y = ((const struct tally *)b)->key;
+    return (x > y) - (x < y);
+}
+
+static int by_count(const void *a, const void *b) {
+    const uint64_t x = ((const struct tally *)a)->count;
+    const uint64_t y = ((const struct tally *)b)->count;
+    return (x < y) - (x > y);
+}
+
+// Adds up tallies with the same key and prints the top ones.
+static void print_top(
+        const char *title,
+        const char *format,
+        struct tally *tallies,
+        size_t count,
+        size_t top) {
+    qsort(tallies, count, sizeof(*tallies), by_key);
+    size_t unique = 0;
+    for (size_t n = 0; n < count; ++n) {
+        if (unique && tallies[unique - 1].key == tallies[n].key) {
+            tallies[unique - 1].count += tallies[n].count;
+            tallies[unique - 1].bytes += tallies[n].bytes;
+        } else {
+            tallies[unique++] = tallies[n];
+        }
+    }
+    qsort(tallies, unique, sizeof(*tallies), by_count);
+
+    printf("%s (%zu in all):\n", title, unique);
+    for (size_t n = 0; n < unique && n < top; ++n) {
+        printf(format, (unsigned long long)tallies[n].key);
+        printf(" %llu allocations, %llu bytes\n",
+                (unsigned long long)tallies[n].count,
+                (unsigned long long)tallies[n].bytes);
+    }
+}
+
+static int by_pointer(const void *a, const void *b) {
+    const struct pool_trace_event *x = a;
+    const struct pool_trace_event *y = b;
+    if (x->pool != y->pool) return (x->pool > y->pool) - (x->pool < y->pool);
+    if (x->ptr != y->ptr) return (x->ptr > y->ptr) - (x->ptr < y->ptr);
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static void print_lifetimes(struct pool_trace_event *events, size_t count) {
+    uint64_t nanoseconds[HISTOGRAM_BUCKETS] = {0};
+    uint64_t lifetimes[HISTOGRAM_BUCKETS] = {0};
+    size_t freed = 0, live = 0, unmatched = 0;
+
+    // Once the events of every pointer are together and in order, each free
+    // follows the allocation it ends.
+    qsort(events, count, sizeof(*events), by_pointer);
+    for (size_t n = 0; n < count; ++n) {
+        const struct pool_trace_event *e = &events[n];
+        const struct pool_trace_event *next = n + 1 < count ? e + 1 : NULL;
+        if (e->kind != POOL_TRACE_ALLOC) {
+            // The allocation happened before the trace started.
+            ++unmatched;
+            continue;
+        }
+        if (!next || next->pool != e->pool || next->ptr != e->ptr
+                || next->kind != POOL_TRACE_FREE) {
+            ++live;
+            continue;
+        }
+
+        ++nanoseconds[bucket(next->time - e->time)];
+        ++lifetimes[bucket(next->seq - e->seq)];
+        ++freed;
+        ++n;
+    }
+
+    printf("freed: %zu, still live: %zu, freed but not allocated in the "
+            "trace: %zu\n", freed, live, unmatched);
+    print_histogram("lifetimes in nanoseconds", nanoseconds);
+    print_histogram("lifetimes in events", lifetimes);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-n top entries] [trace]\n", name);
+}
+
+int main(int argc, char **argv) {
+    size_t top = 16;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            top = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind + 1 < argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    FILE *f = optind < argc ? fopen(argv[optind], "rb") : stdin;
+    if (!f) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    struct trace t = {0};
+    const int error = pool_trace_read(f, &t.header, &t.events);
+    if (f != stdin) fclose(f);
+    if (error) {
+        fprintf(stderr, "%s: couldn't read the trace\n", argv[0]);
+        free(t.events);
+        return 1;
+    }
+
+    const size_t count = t.header.count;
+    struct tally *sizes = malloc(count * sizeof(*sizes) + 1);
+    struct tally *callers = malloc(count * sizeof(*callers) + 1);
+    if (!sizes || !callers) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+
+    uint64_t size_histogram[HISTOGRAM_BUCKETS] = {0};
+    size_t allocs = 0;
+    for (size_t n = 0; n < count; ++n) {
+        const struct pool_trace_event *e = &t.events[n];
+        if (e->kind != POOL_TRACE_ALLOC) continue;
+
+        ++size_histogram[bucket(e->size)];
+        sizes[allocs] = (struct tally){e->size, 1, e->size};
+        callers[allocs] = (struct tally){e->caller, 1, e->size};
+        ++allocs;
+    }
+
+    printf("events: %zu, allocations: %zu, frees: %zu, dropped: %llu\n",
+            count, allocs, count - allocs,
+            (unsigned long long)t.header.dropped);
+    print_histogram("allocations by size", size_histogram);
+    print_top("most common sizes", "  %20llu", sizes, allocs, top);
+    print_top("most active call sites", "  %#20llx", callers, allocs, top);
+    print_lifetimes(t.events, count);
+
+    free(callers);
+    free(sizes);
+    free(t.events);
+    return 0;
+}
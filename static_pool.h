@@ -0,0 +1,213 @@
+#ifndef STATIC_POOL_H_
+#define STATIC_POOL_H_
+
+// A pool whose size and size classes are fixed at compile time, for code
+// that can't allocate at startup. static_pool<Bytes, SizeClasses...> holds
+// its memory inline, so a static_pool with static storage duration is
+// zero-initialized and ready before main without running any code.
+//
+// Blocks use the pool2 format, but they're never split or merged: every
+// allocation is rounded up to the smallest size class that fits and freed
+// blocks go on a free list for their class. Blocks that have never been
+// used are carved off the end of the used part of the arena. When a class
+// has no free blocks and the arena is full, a free block of a bigger class
+// is handed out instead. Like pool2, a static_pool is not thread safe.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "pool2.h"
+#include "pool2_format.h"
+
+namespace pools {
+
+template<std::size_t Bytes, std::size_t... SizeClasses>
+class static_pool {
+    static constexpr std::size_t class_count = sizeof...(SizeClasses);
+    static_assert(class_count > 0, "static_pool needs a size class");
+    static_assert(class_count < 256, "too many size classes");
+
+    static constexpr std::size_t overhead =
+            sizeof(pool2_item_header) + sizeof(pool2_item_footer);
+    static constexpr std::size_t min_block_size =
+            overhead + sizeof(pool2_free_links);
+    static constexpr std::size_t capacity = Bytes / 8 * 8;
+    static_assert(capacity >= min_block_size, "static_pool is too small");
+    static_assert(capacity / 8 < UINT32_MAX, "static_pool is too big");
+
+    static constexpr std::array<std::size_t, class_count> sizes{
+            SizeClasses...};
+
+    static constexpr std::size_t block_size_for(std::size_t size) {
+        const std::size_t block = (size + overhead + 7) / 8 * 8;
+        return block < min_block_size ? min_block_size : block;
+    }
+
+    static constexpr std::array<std::size_t, class_count> block_sizes{
+            block_size_for(SizeClasses)...};
+
+    static constexpr bool classes_are_distinct() {
+        for (std::size_t c = 1; c < class_count; ++c) {
+            if (block_sizes[c] <= block_sizes[c - 1]) return false;
+        }
+        return sizes[0] > 0;
+    }
+    static_assert(classes_are_distinct(),
+            "size classes have to grow and round up to different blocks");
+
+    static constexpr std::size_t max_block_size =
+            block_sizes[class_count - 1];
+    // Blocks are rounded up, so a class can hold a little more than asked.
+    static constexpr std::size_t max_size = max_block_size - overhead;
+
+    // The class for a request of up to n * 8 bytes is size_table[n], the
+    // class of a block of n * 8 bytes is block_table[n].
+    static constexpr auto size_table = [] {
+        std::array<std::uint8_t, max_size / 8 + 1> table{};
+        std::size_t c = 0;
+        for (std::size_t n = 0; n < table.size(); ++n) {
+            while (block_sizes[c] - overhead < n * 8) ++c;
+            table[n] = static_cast<std::uint8_t>(c);
+        }
+        return table;
+    }();
+
+    static constexpr auto block_table = [] {
+        std::array<std::uint8_t, max_block_size / 8 + 1> table{};
+        for (std::size_t c = 0; c < class_count; ++c) {
+            table[block_sizes[c] / 8] = static_cast<std::uint8_t>(c);
+        }
+        return table;
+    }();
+
+public:
+    constexpr static_pool() noexcept = default;
+    static_pool(const static_pool &) = delete;
+    static_pool &operator=(const static_pool &) = delete;
+
+    // The class is picked at compile time.
+    template<std::size_t Size>
+    void *alloc() noexcept {
+        static_assert(Size <= max_size, "no size class fits");
+        return alloc_class(size_table[(Size + 7) / 8]);
+    }
+
+    // Returns nullptr for sizes bigger than the biggest class.
+    void *alloc(std::size_t size) noexcept {
+        if (size > max_size) return nullptr;
+        return alloc_class(size_table[(size + 7) / 8]);
+    }
+
+    void free(void *ptr) noexcept {
+        if (!ptr) return;
+
+        auto *block = static_cast<pool2_item_header *>(ptr) - 1;
+        block->in_use = false;
+        const std::size_t c = block_table[block->size / 8];
+        links(block)->next = free_[c];
+        free_[c] = offset_of(block);
+        --used_blocks_;
+    }
+
+    std::size_t used_blocks() const noexcept { return used_blocks_; }
+
+    // The biggest request that's served.
+    static constexpr std::size_t max_alloc_size() noexcept {
+        return max_size;
+    }
+
+    // Walks the blocks like pool2_walk. The part of the arena no block has
+    // been carved from yet shows up as one free block at the end.
+    void walk(pool2_walk_fn visit, void *arg) const {
+        for (std::size_t offset = 0; offset < top_;) {
+            const auto *block = reinterpret_cast<const pool2_item_header *>(
+                    arena_ + offset);
+            const pool2_block b{
+                    0, offset, block->size, static_cast<int>(block->in_use)};
+            visit(arg, &b);
+            offset += block->size;
+        }
+        if (top_ < capacity) {
+            const pool2_block b{0, top_, capacity - top_, 0};
+            visit(arg, &b);
+        }
+    }
+
+private:
+    // Free list heads hold a block's offset in 8-byte units plus one, so
+    // zero-initialized heads are empty lists.
+    std::uint32_t offset_of(const pool2_item_header *block) const noexcept {
+        return static_cast<std::uint32_t>(
+                (reinterpret_cast<const unsigned char *>(block) - arena_) / 8
+                + 1);
+    }
+
+    pool2_item_header *block_at(std::uint32_t offset) noexcept {
+        return reinterpret_cast<pool2_item_header *>(
+                arena_ + (offset - 1) * std::size_t{8});
+    }
+
+    static pool2_free_links *links(pool2_item_header *block) noexcept {
+        return reinterpret_cast<pool2_free_links *>(block + 1);
+    }
+
+    static pool2_item_footer *footer(pool2_item_header *block) noexcept {
+        return reinterpret_cast<pool2_item_footer *>(
+                reinterpret_cast<unsigned char *>(block) + block->size
+                - sizeof(pool2_item_footer));
+    }
+
+    void *alloc_class(std::size_t c) noexcept {
+        pool2_item_header *block;
+        if (free_[c]) {
+            block = block_at(free_[c]);
+            free_[c] = links(block)->next;
+        } else if (capacity - top_ >= block_sizes[c]) {
+            block = carve(block_sizes[c]);
+        } else {
+            block = borrow(c);
+            if (!block) return nullptr;
+        }
+
+        block->in_use = true;
+        ++used_blocks_;
+        return block + 1;
+    }
+
+    pool2_item_header *carve(std::size_t size) noexcept {
+        if (top_) {
+            auto *last = reinterpret_cast<pool2_item_footer *>(
+                    arena_ + top_) - 1;
+            last->last = false;
+        }
+
+        auto *block = reinterpret_cast<pool2_item_header *>(arena_ + top_);
+        block->size = size;
+        block->first = !top_;
+        footer(block)->size = size;
+        footer(block)->last = true;
+        top_ += size;
+        return block;
+    }
+
+    pool2_item_header *borrow(std::size_t c) noexcept {
+        while (++c < class_count) {
+            if (free_[c]) {
+                pool2_item_header *block = block_at(free_[c]);
+                free_[c] = links(block)->next;
+                return block;
+            }
+        }
+        return nullptr;
+    }
+
+    alignas(8) unsigned char arena_[capacity]{};
+    std::size_t top_{};
+    std::uint32_t free_[class_count]{};
+    std::size_t used_blocks_{};
+};
+
+} // namespace pools
+
+#endif
@@ -0,0 +1,90 @@
+#include "fixed_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+GTEST_TEST(fixed_pool, pool_creation) {
+    struct fixed_pool *p = fixed_pool_create(16, 64);
+    ASSERT_NE(nullptr, p);
+    fixed_pool_destroy(p);
+
+    EXPECT_EQ(nullptr, fixed_pool_create(16, 0));
+}
+
+GTEST_TEST(fixed_pool, alloc_until_empty) {
+    struct fixed_pool *p = fixed_pool_create(sizeof(int64_t), 3);
+
+    void *i = fixed_pool_alloc(p);
+    EXPECT_NE(nullptr, i);
+    void *j = fixed_pool_alloc(p);
+    EXPECT_NE(nullptr, j);
+    void *k = fixed_pool_alloc(p);
+    EXPECT_NE(nullptr, k);
+    EXPECT_EQ(nullptr, fixed_pool_alloc(p));
+
+    fixed_pool_free(p, j);
+    EXPECT_EQ(j, fixed_pool_alloc(p));
+
+    fixed_pool_free(p, i);
+    fixed_pool_free(p, j);
+    fixed_pool_free(p, k);
+
+    fixed_pool_destroy(p);
+}
+
+GTEST_TEST(fixed_pool, alignment) {
+    struct fixed_pool *p = fixed_pool_create(sizeof(char) * 3, 16);
+
+    for (int i = 0; i < 16; ++i) {
+        void *ptr = fixed_pool_alloc(p);
+        ASSERT_NE(nullptr, ptr);
+        EXPECT_EQ(0, (uintptr_t)ptr % 8);
+    }
+
+    fixed_pool_destroy(p);
+}
+
+GTEST_TEST(fixed_pool, concurrent_alloc_and_free) {
+    constexpr auto threads = 8;
+    constexpr auto iterations = 100000;
+    constexpr auto blocks = 64;
+
+    struct fixed_pool *p = fixed_pool_create(sizeof(int64_t), blocks);
+    std::vector<std::thread> workers{};
+
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([p, t] {
+            for (int i = 0; i < iterations; ++i) {
+                auto *v = (int64_t *)fixed_pool_alloc(p);
+                if (!v) continue;
+                *v = t;
+                std::this_thread::yield();
+                EXPECT_EQ(t, *v);
+                fixed_pool_free(p, v);
+            }
+        });
+    }
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    // Every block should have made it back to the pool exactly once.
+    std::vector<void *> allocs{};
+    while (void *ptr = fixed_pool_alloc(p)) {
+        allocs.push_back(ptr);
+    }
+    EXPECT_EQ(blocks, allocs.size());
+    std::sort(allocs.begin(), allocs.end());
+    EXPECT_EQ(allocs.end(), std::adjacent_find(allocs.begin(), allocs.end()));
+
+    fixed_pool_destroy(p);
+}
+
+} // namespace
@@ -1,19 +1,47 @@
 #include "good_pool.h"
 
 #include <cstdint>
+#include <cstring>
 #include <list>
 #include <random>
+#include <thread>
+#include <vector>
 
 #include <gtest/gtest.h>
 
 namespace {
 
+// What every allocation costs on top of its size.
+#ifdef GOOD_POOL_COMPACT_HEADERS
+constexpr size_t block_overhead = sizeof(uint32_t) * 2;
+#else
+constexpr size_t block_overhead = sizeof(void *) * 2;
+#endif
+
 GTEST_TEST(good_pool, pool_creation) {
     struct good_pool *p = pool_create(1024);
     ASSERT_NE(nullptr, p);
     pool_destroy(p);
 }
 
+GTEST_TEST(good_pool, pool_creation_in_buffer) {
+    alignas(8) static char buf[16 * 1024];
+    struct good_pool *p = pool_create_in(buf, sizeof(buf));
+    ASSERT_NE(nullptr, p);
+    EXPECT_GT(sizeof(buf), pool_available(p));
+
+    char *i = (char *)pool_alloc(p, 1024);
+    ASSERT_NE(nullptr, i);
+    EXPECT_LE(buf, i);
+    EXPECT_GE(buf + sizeof(buf), i + 1024);
+    EXPECT_EQ(0, (uintptr_t)i % 8);
+    pool_free(p, i);
+
+    pool_destroy(p);
+
+    EXPECT_EQ(nullptr, pool_create_in(buf, 16));
+}
+
 GTEST_TEST(good_pool, alloc_and_free_ints) {
     struct good_pool *p = pool_create(80);
 
@@ -101,14 +129,25 @@ GTEST_TEST(good_pool, alignment) {
 }
 
 GTEST_TEST(good_pool, overhead) {
-    constexpr auto expected_overhead = sizeof(void *) * 2;
-    struct good_pool *p = pool_create(sizeof(double) + expected_overhead);
+    struct good_pool *p = pool_create(sizeof(double) + block_overhead);
 
     double *i = (double *)pool_alloc(p, sizeof(double));
     ASSERT_NE(nullptr, i);
     pool_free(p, i);
 
     pool_destroy(p);
+
+    // 16-byte objects cost 16 + block_overhead bytes each, so compact
+    // headers fit a third more of them.
+    constexpr auto objects = 64;
+    p = pool_create(objects * (16 + block_overhead));
+    for (int j = 0; j < objects; ++j) {
+        ASSERT_NE(nullptr, pool_alloc(p, 16));
+    }
+    EXPECT_EQ(nullptr, pool_alloc(p, 1));
+    EXPECT_EQ(objects * (16 + block_overhead), pool_allocated(p));
+
+    pool_destroy(p);
 }
 
 GTEST_TEST(good_pool, block_count) {
@@ -146,9 +185,7 @@ GTEST_TEST(good_pool, block_count) {
     EXPECT_EQ(1, pool_used_blocks(p));
 
     pool_free(p, bot);
-    // Requires 2 passes of coalescing.
-    // Is it worth it?
-    //EXPECT_EQ(1, pool_free_blocks(p));
+    EXPECT_EQ(1, pool_free_blocks(p));
     EXPECT_EQ(0, pool_used_blocks(p));
 
     pool_destroy(p);
@@ -189,4 +226,437 @@ GTEST_TEST(good_pool, randoms_allocs) {
     pool_destroy(p);
 }
 
+GTEST_TEST(good_pool, realloc) {
+    struct good_pool *p = pool_create(4096);
+
+    // Grows into the free space after it without moving.
+    auto *a = (unsigned char *)pool_realloc(p, nullptr, 100);
+    ASSERT_NE(nullptr, a);
+    memset(a, 1, 100);
+    EXPECT_EQ(a, pool_realloc(p, a, 1000));
+    EXPECT_EQ(1, a[99]);
+
+    // Shrinking gives the end back.
+    const auto available = pool_available(p);
+    EXPECT_EQ(a, pool_realloc(p, a, 100));
+    EXPECT_LT(available, pool_available(p));
+
+    // Blocked by b, so it has to move.
+    void *b = pool_alloc(p, 100);
+    auto *moved = (unsigned char *)pool_realloc(p, a, 1000);
+    ASSERT_NE(nullptr, moved);
+    EXPECT_NE(a, moved);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(1, moved[i]);
+    }
+    EXPECT_EQ(2, pool_used_blocks(p));
+
+    // Failing leaves the block alone.
+    EXPECT_EQ(nullptr, pool_realloc(p, moved, 8192));
+    EXPECT_EQ(1, moved[0]);
+
+    EXPECT_EQ(nullptr, pool_realloc(p, moved, 0));
+    pool_free(p, b);
+    EXPECT_EQ(4096, pool_available(p));
+    EXPECT_EQ(1, pool_free_blocks(p));
+
+    pool_destroy(p);
+}
+
+GTEST_TEST(good_pool, aligned_alloc) {
+    constexpr auto pool_size = 64 * 1024;
+    struct good_pool *p = pool_create(pool_size);
+    std::vector<void *> ptrs{};
+
+    for (size_t align = 1; align <= 4096; align *= 2) {
+        for (size_t size : {1, 24, 100, 1000}) {
+            void *ptr = pool_alloc_aligned(p, size, align);
+            ASSERT_NE(nullptr, ptr);
+            EXPECT_EQ(0, (uintptr_t)ptr % align);
+            EXPECT_EQ(0, (uintptr_t)ptr % 8);
+            memset(ptr, 0xff, size);
+            ptrs.push_back(ptr);
+        }
+    }
+
+    EXPECT_EQ(nullptr, pool_alloc_aligned(p, 16, 0));
+    EXPECT_EQ(nullptr, pool_alloc_aligned(p, 16, 48));
+    EXPECT_EQ(nullptr, pool_alloc_aligned(p, pool_size, 64));
+
+    for (auto ptr : ptrs) {
+        pool_free(p, ptr);
+    }
+    EXPECT_EQ(pool_size, pool_available(p));
+    EXPECT_EQ(1, pool_free_blocks(p));
+
+    // The padding in front of an aligned block is handed out again.
+    void *aligned = pool_alloc_aligned(p, 64, 4096);
+    ASSERT_NE(nullptr, aligned);
+    EXPECT_GT(aligned, pool_alloc(p, 8));
+
+    pool_destroy(p);
+}
+
+GTEST_TEST(good_pool, batch_alloc_and_free) {
+    constexpr auto batch = 64;
+    struct good_pool *p = pool_create(64 * 1024);
+    void *ptrs[batch];
+
+    ASSERT_EQ(batch, pool_alloc_batch(p, 48, batch, ptrs));
+    EXPECT_EQ(batch, pool_used_blocks(p));
+    EXPECT_EQ(1, pool_free_blocks(p));
+    for (int i = 0; i < batch; ++i) {
+        memset(ptrs[i], i, 48);
+    }
+    for (int i = 0; i < batch; ++i) {
+        EXPECT_EQ(i, *(unsigned char *)ptrs[i]);
+    }
+
+    // Every other block first, so the rest is freed next to free blocks.
+    void *odd[batch / 2];
+    for (int i = 0; i < batch / 2; ++i) {
+        odd[i] = ptrs[i * 2 + 1];
+    }
+    pool_free_batch(p, odd, batch / 2);
+    EXPECT_EQ(batch / 2, pool_used_blocks(p));
+    // The last one merges with the free block after it.
+    EXPECT_EQ(batch / 2, pool_free_blocks(p));
+
+    for (int i = 0; i < batch / 2; ++i) {
+        pool_free(p, ptrs[i * 2]);
+    }
+    EXPECT_EQ(64 * 1024, pool_available(p));
+    EXPECT_EQ(1, pool_free_blocks(p));
+
+    // Runs of blocks in ptrs are freed in one go.
+    ASSERT_EQ(batch, pool_alloc_batch(p, 48, batch, ptrs));
+    pool_free_batch(p, ptrs, batch);
+    EXPECT_EQ(64 * 1024, pool_available(p));
+    EXPECT_EQ(1, pool_free_blocks(p));
+    EXPECT_EQ(0, pool_used_blocks(p));
+
+    // Gets as many as fit.
+    EXPECT_GT(batch, pool_alloc_batch(p, 4096, batch, ptrs));
+
+    pool_destroy(p);
+}
+
+GTEST_TEST(good_pool, deferred_frees) {
+    struct good_pool *p = pool_create(4096);
+    pool_set_deferred_frees(p, 64);
+
+    // Freed blocks wait to be merged and go straight back out.
+    void *i = pool_alloc(p, 32);
+    void *j = pool_alloc(p, 32);
+    pool_free(p, i);
+    pool_free(p, j);
+    EXPECT_EQ(2, pool_used_blocks(p));
+    EXPECT_EQ(j, pool_alloc(p, 32));
+    EXPECT_EQ(i, pool_alloc(p, 32));
+    pool_free(p, i);
+    pool_free(p, j);
+
+    // Running out of memory merges them.
+    void *big = pool_alloc(p, 4096 - block_overhead);
+    ASSERT_NE(nullptr, big);
+    pool_free(p, big);
+    EXPECT_EQ(4096, pool_available(p));
+
+    // So does going over the budget.
+    std::vector<void *> ptrs{};
+    for (int k = 0; k < 100; ++k) {
+        ptrs.push_back(pool_alloc(p, 16));
+        ASSERT_NE(nullptr, ptrs.back());
+    }
+    for (auto ptr : ptrs) {
+        pool_free(p, ptr);
+    }
+    EXPECT_GE(64, pool_used_blocks(p));
+    EXPECT_LT(0, pool_used_blocks(p));
+
+    pool_trim(p);
+    EXPECT_EQ(4096, pool_available(p));
+    EXPECT_EQ(1, pool_free_blocks(p));
+
+    pool_destroy(p);
+}
+
+GTEST_TEST(good_pool, scratch_region) {
+    constexpr auto pool_size = 1024 * 1024;
+    struct good_pool *p = pool_create(pool_size);
+
+    char *a = (char *)pool_alloc_scratch(p, 10);
+    char *b = (char *)pool_alloc_scratch(p, 10);
+    ASSERT_NE(nullptr, a);
+    ASSERT_NE(nullptr, b);
+    EXPECT_EQ(a + 16, b);
+    EXPECT_EQ(1, pool_used_blocks(p));
+
+    const struct pool_region_mark mark = pool_mark(p);
+    std::vector<char *> ptrs{};
+    for (int i = 0; i < 5000; ++i) {
+        ptrs.push_back((char *)pool_alloc_scratch(p, 100));
+        ASSERT_NE(nullptr, ptrs.back());
+        EXPECT_EQ(0, (uintptr_t)ptrs.back() % 8);
+        memset(ptrs.back(), i, 100);
+    }
+    EXPECT_LT(1, pool_used_blocks(p));
+
+    // Everything after the mark goes away, a and b stay.
+    pool_release_to(p, mark);
+    EXPECT_EQ(1, pool_used_blocks(p));
+    EXPECT_EQ(b + 16, pool_alloc_scratch(p, 1));
+
+    // Big allocations get a chunk of their own.
+    EXPECT_NE(nullptr, pool_alloc_scratch(p, 256 * 1024));
+    EXPECT_EQ(nullptr, pool_alloc_scratch(p, pool_size));
+
+    pool_reset(p);
+    EXPECT_EQ(pool_size, pool_available(p));
+    EXPECT_EQ(0, pool_used_blocks(p));
+
+    pool_destroy(p);
+}
+
+GTEST_TEST(good_pool, scratch_region_in_small_pool) {
+    struct good_pool *p = pool_create(1024);
+
+    // The pool is smaller than a chunk, so chunks are only as big as needed.
+    const struct pool_region_mark mark = pool_mark(p);
+    EXPECT_NE(nullptr, pool_alloc_scratch(p, 100));
+    EXPECT_NE(nullptr, pool_alloc_scratch(p, 0));
+    EXPECT_NE(nullptr, pool_alloc_scratch(p, 500));
+    EXPECT_EQ(nullptr, pool_alloc_scratch(p, 500));
+
+    pool_release_to(p, mark);
+    EXPECT_EQ(1024, pool_available(p));
+
+    pool_destroy(p);
+}
+
+GTEST_TEST(good_pool, walk) {
+    struct good_pool *p = pool_create(4096);
+    void *i = pool_alloc(p, 100);
+    void *j = pool_alloc(p, 200);
+    void *k = pool_alloc(p, 300);
+    pool_free(p, j);
+
+    std::vector<struct pool_block> blocks{};
+    pool_walk(p, [](void *arg, const struct pool_block *block) {
+        static_cast<std::vector<struct pool_block> *>(arg)->push_back(*block);
+    }, &blocks);
+
+    ASSERT_EQ(4, blocks.size());
+    size_t offset = 0;
+    for (const auto &block : blocks) {
+        EXPECT_EQ(0, block.arena);
+        EXPECT_EQ(offset, block.offset);
+        offset += block.sz;
+    }
+    EXPECT_EQ(4096, offset);
+    EXPECT_TRUE(blocks[0].in_use);
+    EXPECT_FALSE(blocks[1].in_use);
+    EXPECT_TRUE(blocks[2].in_use);
+    EXPECT_FALSE(blocks[3].in_use);
+
+    struct pool_fragmentation fragmentation{};
+    pool_get_fragmentation(p, &fragmentation);
+    EXPECT_EQ(pool_available(p), fragmentation.free_bytes);
+    EXPECT_EQ(2, fragmentation.free_blocks);
+    EXPECT_EQ(blocks[3].sz, fragmentation.largest_free_block);
+    EXPECT_DOUBLE_EQ(
+            (double)blocks[1].sz / fragmentation.free_bytes,
+            fragmentation.fragmentation);
+    size_t histogram_blocks = 0;
+    for (size_t n = 0; n < POOL_HISTOGRAM_BUCKETS; ++n) {
+        histogram_blocks += fragmentation.histogram[n];
+    }
+    EXPECT_EQ(2, histogram_blocks);
+    EXPECT_EQ(1, fragmentation.histogram[7]);
+
+    pool_free(p, i);
+    pool_free(p, k);
+    pool_get_fragmentation(p, &fragmentation);
+    EXPECT_EQ(0, fragmentation.fragmentation);
+
+    pool_destroy(p);
+}
+
+GTEST_TEST(good_pool, stats) {
+    struct good_pool *p = pool_create(1024);
+    struct pool_stats stats{};
+    pool_get_stats(p, &stats);
+    EXPECT_EQ(1024, stats.available);
+    EXPECT_EQ(0, stats.allocated);
+    EXPECT_EQ(1, stats.free_blocks);
+    EXPECT_EQ(0, stats.used_blocks);
+    EXPECT_EQ(0, stats.peak_allocated);
+    EXPECT_EQ(1024, stats.largest_free_block);
+
+    void *i = pool_alloc(p, 256);
+    void *j = pool_alloc(p, 256);
+    void *k = pool_alloc(p, 256);
+    EXPECT_EQ(nullptr, pool_alloc(p, 512));
+    pool_free(p, j);
+
+    pool_get_stats(p, &stats);
+    EXPECT_EQ(pool_available(p), stats.available);
+    EXPECT_EQ(pool_allocated(p), stats.allocated);
+    EXPECT_EQ(2, stats.free_blocks);
+    EXPECT_EQ(2, stats.used_blocks);
+    EXPECT_EQ(3 * (256 + block_overhead), stats.peak_allocated);
+    EXPECT_EQ(256 + block_overhead, stats.largest_free_block);
+    EXPECT_EQ(3, stats.allocs);
+    EXPECT_EQ(1, stats.frees);
+    EXPECT_EQ(1, stats.failures);
+
+    pool_free(p, i);
+    pool_free(p, k);
+    pool_get_stats(p, &stats);
+    EXPECT_EQ(1024, stats.available);
+    EXPECT_EQ(3 * (256 + block_overhead), stats.peak_allocated);
+    EXPECT_EQ(1024, stats.largest_free_block);
+
+    pool_destroy(p);
+}
+
+#ifdef GOOD_POOL_COMPACT_HEADERS
+GTEST_TEST(good_pool, compact_pools_dont_grow) {
+    struct good_pool *p = pool_create(1024);
+    pool_set_growth(p, POOL_GROW_DOUBLE, 0);
+    EXPECT_EQ(nullptr, pool_alloc(p, 2048));
+    void *blocks[4];
+    EXPECT_EQ(0, pool_alloc_batch(p, 2048, 4, blocks));
+    EXPECT_EQ(1024, pool_available(p));
+
+    pool_destroy(p);
+}
+#else
+GTEST_TEST(good_pool, growth) {
+    struct good_pool *p = pool_create(1024);
+    EXPECT_EQ(nullptr, pool_alloc(p, 2048));
+
+    pool_set_growth(p, POOL_GROW_DOUBLE, 0);
+    void *i = pool_alloc(p, 2048);
+    ASSERT_NE(nullptr, i);
+    EXPECT_LT(1024 + 2048, pool_available(p) + pool_allocated(p));
+
+    std::vector<void *> allocs{};
+    for (int j = 0; j < 1000; ++j) {
+        allocs.push_back(pool_alloc(p, 64));
+        ASSERT_NE(nullptr, allocs.back());
+    }
+
+    pool_free(p, i);
+    for (auto alloc : allocs) {
+        pool_free(p, alloc);
+    }
+    EXPECT_EQ(0, pool_used_blocks(p));
+
+    pool_trim(p);
+    EXPECT_EQ(1024, pool_available(p));
+    EXPECT_EQ(1, pool_free_blocks(p));
+
+    pool_destroy(p);
+}
+
+GTEST_TEST(good_pool, fixed_growth) {
+    struct good_pool *p = pool_create(1024);
+    pool_set_growth(p, POOL_GROW_FIXED, 4096);
+
+    void *i = pool_alloc(p, 512);
+    void *j = pool_alloc(p, 512);
+    ASSERT_NE(nullptr, i);
+    ASSERT_NE(nullptr, j);
+    EXPECT_EQ(1024 + 4096, pool_available(p) + pool_allocated(p));
+
+    // The added arena isn't empty, so it stays.
+    pool_free(p, i);
+    pool_trim(p);
+    EXPECT_EQ(1024 + 4096, pool_available(p) + pool_allocated(p));
+
+    pool_free(p, j);
+    pool_trim(p);
+    EXPECT_EQ(1024, pool_available(p));
+
+    pool_destroy(p);
+}
+#endif
+
+GTEST_TEST(good_pool, shared_pool) {
+    constexpr auto threads = 8;
+    constexpr auto iterations = 20000;
+    constexpr auto pool_size = 1024 * 1024;
+
+    struct good_pool *p = pool_create_shared(pool_size);
+    ASSERT_NE(nullptr, p);
+    std::vector<std::thread> workers{};
+
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([p, t] {
+            auto rng{std::minstd_rand(t + 1)};
+            std::list<int64_t *> allocs{};
+            for (int i = 0; i < iterations; ++i) {
+                if (allocs.size() < 64 && rng() % 2) {
+                    auto *v = (int64_t *)pool_alloc(p, rng() % 512);
+                    ASSERT_NE(nullptr, v);
+                    *v = t;
+                    allocs.push_back(v);
+                } else if (!allocs.empty()) {
+                    EXPECT_EQ(t, *allocs.front());
+                    pool_free(p, allocs.front());
+                    allocs.pop_front();
+                }
+            }
+            for (auto alloc : allocs) {
+                pool_free(p, alloc);
+            }
+        });
+    }
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    // Exiting threads hand their cached blocks back to the pool.
+    EXPECT_EQ(pool_size, pool_available(p));
+    EXPECT_EQ(1, pool_free_blocks(p));
+
+    struct pool_stats stats{};
+    pool_get_stats(p, &stats);
+    EXPECT_LT(0, stats.allocs);
+    EXPECT_EQ(stats.allocs, stats.frees);
+    EXPECT_EQ(0, stats.failures);
+
+    pool_destroy(p);
+}
+
+GTEST_TEST(good_pool, shared_pool_cross_thread_free) {
+    constexpr auto allocs = 10000;
+
+    struct good_pool *p = pool_create_shared(64 * 1024);
+    std::vector<void *> ptrs(allocs);
+
+    for (int i = 0; i < allocs; i += 100) {
+        std::thread producer([&] {
+            for (int j = i; j < i + 100; ++j) {
+                ptrs[j] = pool_alloc(p, 32);
+                ASSERT_NE(nullptr, ptrs[j]);
+            }
+        });
+        producer.join();
+
+        std::thread consumer([&] {
+            for (int j = i; j < i + 100; ++j) {
+                pool_free(p, ptrs[j]);
+            }
+        });
+        consumer.join();
+    }
+
+    EXPECT_EQ(0, pool_used_blocks(p));
+
+    pool_destroy(p);
+}
+
 } // namespace
@@ -1,8 +1,18 @@
 #include "pool2.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <list>
 #include <random>
+#include <string>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -104,7 +114,7 @@ GTEST_TEST(pool2, alignment) {
 }
 
 GTEST_TEST(pool2, overhead) {
-    constexpr auto expected_overhead = sizeof(unsigned) * 3;
+    constexpr auto expected_overhead = sizeof(uint64_t) * 2;
     struct pool2 *p = pool2_create(sizeof(double) + expected_overhead);
 
     double *i = (double *)pool2_alloc(p, sizeof(double));
@@ -190,4 +200,683 @@ GTEST_TEST(pool2, randoms_allocs) {
     pool2_destroy(p);
 }
 
+GTEST_TEST(pool2, realloc) {
+    struct pool2 *p = pool2_create(4096);
+
+    // Grows into the free space after it without moving.
+    auto *a = (unsigned char *)pool2_realloc(p, nullptr, 100);
+    ASSERT_NE(nullptr, a);
+    memset(a, 1, 100);
+    EXPECT_EQ(a, pool2_realloc(p, a, 1000));
+    EXPECT_EQ(1, a[99]);
+
+    // Shrinking gives the end back.
+    const auto available = pool2_available(p);
+    EXPECT_EQ(a, pool2_realloc(p, a, 100));
+    EXPECT_LT(available, pool2_available(p));
+
+    // Blocked by b, so it has to move.
+    void *b = pool2_alloc(p, 100);
+    auto *moved = (unsigned char *)pool2_realloc(p, a, 1000);
+    ASSERT_NE(nullptr, moved);
+    EXPECT_NE(a, moved);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(1, moved[i]);
+    }
+    EXPECT_EQ(2, pool2_used_blocks(p));
+
+    // Failing leaves the block alone.
+    EXPECT_EQ(nullptr, pool2_realloc(p, moved, 8192));
+    EXPECT_EQ(1, moved[0]);
+
+    EXPECT_EQ(nullptr, pool2_realloc(p, moved, 0));
+    pool2_free(p, b);
+    EXPECT_EQ(4096, pool2_available(p));
+    EXPECT_EQ(1, pool2_free_blocks(p));
+
+    pool2_destroy(p);
+}
+
+GTEST_TEST(pool2, aligned_alloc) {
+    constexpr auto pool_size = 64 * 1024;
+    struct pool2 *p = pool2_create(pool_size);
+    std::vector<void *> ptrs{};
+
+    for (size_t align = 1; align <= 4096; align *= 2) {
+        for (size_t size : {1, 24, 100, 1000}) {
+            void *ptr = pool2_alloc_aligned(p, size, align);
+            ASSERT_NE(nullptr, ptr);
+            EXPECT_EQ(0, (uintptr_t)ptr % align);
+            EXPECT_EQ(0, (uintptr_t)ptr % 8);
+            memset(ptr, 0xff, size);
+            ptrs.push_back(ptr);
+        }
+    }
+
+    EXPECT_EQ(nullptr, pool2_alloc_aligned(p, 16, 0));
+    EXPECT_EQ(nullptr, pool2_alloc_aligned(p, 16, 48));
+    EXPECT_EQ(nullptr, pool2_alloc_aligned(p, pool_size, 64));
+
+    for (auto ptr : ptrs) {
+        pool2_free(p, ptr);
+    }
+    EXPECT_EQ(pool_size, pool2_available(p));
+    EXPECT_EQ(1, pool2_free_blocks(p));
+
+    // The padding in front of an aligned block is handed out again.
+    void *aligned = pool2_alloc_aligned(p, 64, 4096);
+    ASSERT_NE(nullptr, aligned);
+    EXPECT_GT(aligned, pool2_alloc(p, 8));
+
+    pool2_destroy(p);
+}
+
+GTEST_TEST(pool2, batch_alloc_and_free) {
+    constexpr auto batch = 64;
+    struct pool2 *p = pool2_create(64 * 1024);
+    void *ptrs[batch];
+
+    ASSERT_EQ(batch, pool2_alloc_batch(p, 48, batch, ptrs));
+    EXPECT_EQ(batch, pool2_used_blocks(p));
+    EXPECT_EQ(1, pool2_free_blocks(p));
+    for (int i = 0; i < batch; ++i) {
+        memset(ptrs[i], i, 48);
+    }
+    for (int i = 0; i < batch; ++i) {
+        EXPECT_EQ(i, *(unsigned char *)ptrs[i]);
+    }
+
+    // Every other block first, so the rest is freed next to free blocks.
+    void *odd[batch / 2];
+    for (int i = 0; i < batch / 2; ++i) {
+        odd[i] = ptrs[i * 2 + 1];
+    }
+    pool2_free_batch(p, odd, batch / 2);
+    EXPECT_EQ(batch / 2, pool2_used_blocks(p));
+    // The last one merges with the free block after it.
+    EXPECT_EQ(batch / 2, pool2_free_blocks(p));
+
+    for (int i = 0; i < batch / 2; ++i) {
+        pool2_free(p, ptrs[i * 2]);
+    }
+    EXPECT_EQ(64 * 1024, pool2_available(p));
+    EXPECT_EQ(1, pool2_free_blocks(p));
+
+    // Runs of blocks in ptrs are freed in one go.
+    ASSERT_EQ(batch, pool2_alloc_batch(p, 48, batch, ptrs));
+    pool2_free_batch(p, ptrs, batch);
+    EXPECT_EQ(64 * 1024, pool2_available(p));
+    EXPECT_EQ(1, pool2_free_blocks(p));
+    EXPECT_EQ(0, pool2_used_blocks(p));
+
+    // Gets as many as fit.
+    EXPECT_GT(batch, pool2_alloc_batch(p, 4096, batch, ptrs));
+
+    pool2_destroy(p);
+}
+
+GTEST_TEST(pool2, walk) {
+    struct pool2 *p = pool2_create(4096);
+    void *i = pool2_alloc(p, 100);
+    void *j = pool2_alloc(p, 200);
+    void *k = pool2_alloc(p, 300);
+    pool2_free(p, j);
+
+    std::vector<struct pool2_block> blocks{};
+    pool2_walk(p, [](void *arg, const struct pool2_block *block) {
+        static_cast<std::vector<struct pool2_block> *>(arg)->push_back(*block);
+    }, &blocks);
+
+    ASSERT_EQ(4, blocks.size());
+    size_t offset = 0;
+    for (const auto &block : blocks) {
+        EXPECT_EQ(0, block.arena);
+        EXPECT_EQ(offset, block.offset);
+        offset += block.size;
+    }
+    EXPECT_EQ(4096, offset);
+    EXPECT_TRUE(blocks[0].in_use);
+    EXPECT_FALSE(blocks[1].in_use);
+    EXPECT_TRUE(blocks[2].in_use);
+    EXPECT_FALSE(blocks[3].in_use);
+
+    struct pool2_fragmentation fragmentation{};
+    pool2_get_fragmentation(p, &fragmentation);
+    EXPECT_EQ(pool2_available(p), fragmentation.free_bytes);
+    EXPECT_EQ(2, fragmentation.free_blocks);
+    EXPECT_EQ(blocks[3].size, fragmentation.largest_free_block);
+    EXPECT_DOUBLE_EQ(
+            (double)blocks[1].size / fragmentation.free_bytes,
+            fragmentation.fragmentation);
+    size_t histogram_blocks = 0;
+    for (size_t n = 0; n < POOL2_HISTOGRAM_BUCKETS; ++n) {
+        histogram_blocks += fragmentation.histogram[n];
+    }
+    EXPECT_EQ(2, histogram_blocks);
+    EXPECT_EQ(1, fragmentation.histogram[7]);
+
+    pool2_free(p, i);
+    pool2_free(p, k);
+    pool2_get_fragmentation(p, &fragmentation);
+    EXPECT_EQ(0, fragmentation.fragmentation);
+
+    pool2_destroy(p);
+}
+
+GTEST_TEST(pool2, stats) {
+    struct pool2 *p = pool2_create(1024);
+    struct pool2_stats stats{};
+    pool2_get_stats(p, &stats);
+    EXPECT_EQ(1024, stats.available);
+    EXPECT_EQ(0, stats.allocated);
+    EXPECT_EQ(1, stats.free_blocks);
+    EXPECT_EQ(0, stats.used_blocks);
+    EXPECT_EQ(0, stats.peak_allocated);
+    EXPECT_EQ(1024, stats.largest_free_block);
+
+    void *i = pool2_alloc(p, 256);
+    void *j = pool2_alloc(p, 256);
+    void *k = pool2_alloc(p, 256);
+    EXPECT_EQ(nullptr, pool2_alloc(p, 512));
+    pool2_free(p, j);
+
+    pool2_get_stats(p, &stats);
+    EXPECT_EQ(pool2_available(p), stats.available);
+    EXPECT_EQ(pool2_allocated(p), stats.allocated);
+    EXPECT_EQ(2, stats.free_blocks);
+    EXPECT_EQ(2, stats.used_blocks);
+    EXPECT_EQ(3 * (256 + 16), stats.peak_allocated);
+    EXPECT_EQ(256 + 16, stats.largest_free_block);
+    EXPECT_EQ(3, stats.allocs);
+    EXPECT_EQ(1, stats.frees);
+    EXPECT_EQ(1, stats.failures);
+
+    pool2_free(p, i);
+    pool2_free(p, k);
+    pool2_get_stats(p, &stats);
+    EXPECT_EQ(1024, stats.available);
+    EXPECT_EQ(1, stats.free_blocks);
+    EXPECT_EQ(3 * (256 + 16), stats.peak_allocated);
+    EXPECT_EQ(1024, stats.largest_free_block);
+
+    pool2_destroy(p);
+}
+
+GTEST_TEST(pool2, growth) {
+    struct pool2 *p = pool2_create(1024);
+    EXPECT_EQ(nullptr, pool2_alloc(p, 2048));
+
+    pool2_set_growth(p, POOL2_GROW_DOUBLE, 0);
+    void *i = pool2_alloc(p, 2048);
+    ASSERT_NE(nullptr, i);
+    EXPECT_LT(1024 + 2048, pool2_available(p) + pool2_allocated(p));
+    EXPECT_EQ(1, pool2_owns(p, i));
+    EXPECT_EQ(0, pool2_owns(p, &i));
+
+    std::vector<void *> allocs{};
+    for (int j = 0; j < 1000; ++j) {
+        allocs.push_back(pool2_alloc(p, 64));
+        ASSERT_NE(nullptr, allocs.back());
+        EXPECT_EQ(1, pool2_owns(p, allocs.back()));
+    }
+
+    pool2_free(p, i);
+    for (auto alloc : allocs) {
+        pool2_free(p, alloc);
+    }
+    EXPECT_EQ(0, pool2_used_blocks(p));
+
+    pool2_trim(p);
+    EXPECT_EQ(1024, pool2_available(p));
+    EXPECT_EQ(1, pool2_free_blocks(p));
+
+    pool2_destroy(p);
+}
+
+GTEST_TEST(pool2, fixed_growth) {
+    struct pool2 *p = pool2_create(1024);
+    pool2_set_growth(p, POOL2_GROW_FIXED, 4096);
+
+    void *i = pool2_alloc(p, 512);
+    void *j = pool2_alloc(p, 512);
+    ASSERT_NE(nullptr, i);
+    ASSERT_NE(nullptr, j);
+    EXPECT_EQ(1024 + 4096, pool2_available(p) + pool2_allocated(p));
+
+    // The added arena isn't empty, so it stays.
+    pool2_free(p, i);
+    pool2_trim(p);
+    EXPECT_EQ(1024 + 4096, pool2_available(p) + pool2_allocated(p));
+
+    pool2_free(p, j);
+    pool2_trim(p);
+    EXPECT_EQ(1024, pool2_available(p));
+
+    pool2_destroy(p);
+}
+
+GTEST_TEST(pool2, mapped_pool) {
+    constexpr auto pool2_size = 1024 * 1024 * 1024;
+    constexpr auto allocs = 64 * 1024;
+    constexpr auto item_size = 1024;
+
+    struct pool2 *p = pool2_create_mapped(pool2_size, 0);
+    ASSERT_NE(nullptr, p);
+    const auto available = pool2_available(p);
+    EXPECT_LE(pool2_size, available);
+    struct pool2_stats stats{};
+    pool2_get_stats(p, &stats);
+    EXPECT_EQ(available, stats.largest_free_block);
+
+    // Goes well past what's committed up front.
+    std::vector<void *> ptrs{};
+    for (int i = 0; i < allocs; ++i) {
+        ptrs.push_back(pool2_alloc(p, item_size));
+        ASSERT_NE(nullptr, ptrs.back());
+        memset(ptrs.back(), 0xff, item_size);
+    }
+    EXPECT_EQ(allocs, pool2_used_blocks(p));
+
+    for (auto ptr : ptrs) {
+        pool2_free(p, ptr);
+    }
+    EXPECT_EQ(available, pool2_available(p));
+    EXPECT_EQ(1, pool2_free_blocks(p));
+
+    pool2_destroy(p);
+}
+
+GTEST_TEST(pool2, mapped_pool_realloc) {
+    struct pool2 *p = pool2_create_mapped(64 * 1024 * 1024, 0);
+    ASSERT_NE(nullptr, p);
+
+    // The last block grows into memory that isn't committed yet.
+    void *buf = pool2_realloc(p, nullptr, 1024);
+    for (size_t size = 2048; size <= 32 * 1024 * 1024; size *= 2) {
+        void *grown = pool2_realloc(p, buf, size);
+        ASSERT_EQ(buf, grown);
+        memset(grown, 0xff, size);
+    }
+
+    pool2_free(p, buf);
+    pool2_destroy(p);
+}
+
+GTEST_TEST(pool2, mapped_pool_exhaustion) {
+    struct pool2 *p = pool2_create_mapped(1024 * 1024, 0);
+    ASSERT_NE(nullptr, p);
+
+    std::vector<void *> ptrs{};
+    while (void *ptr = pool2_alloc(p, 4096)) {
+        ptrs.push_back(ptr);
+    }
+    EXPECT_LT(200, ptrs.size());
+    EXPECT_GT(4096, pool2_available(p));
+
+    for (auto ptr : ptrs) {
+        pool2_free(p, ptr);
+    }
+
+    pool2_destroy(p);
+}
+
+GTEST_TEST(pool2, mapped_pool_with_huge_blocks) {
+    constexpr auto pool2_size = 8ull * 1024 * 1024 * 1024;
+    constexpr auto block_size = 2ull * 1024 * 1024 * 1024 + 1;
+
+    struct pool2 *p = pool2_create_mapped(pool2_size, POOL2_MAP_THP);
+    ASSERT_NE(nullptr, p);
+    EXPECT_LE(pool2_size, pool2_available(p));
+
+    char *i = (char *)pool2_alloc(p, block_size);
+    ASSERT_NE(nullptr, i);
+    EXPECT_EQ(0, (uintptr_t)i % 8);
+    i[0] = 1;
+    i[block_size - 1] = 1;
+    EXPECT_LT(block_size, pool2_allocated(p));
+
+    char *j = (char *)pool2_alloc(p, 16);
+    ASSERT_NE(nullptr, j);
+    EXPECT_LT(i + block_size, j);
+
+    pool2_free(p, i);
+    pool2_free(p, j);
+    EXPECT_EQ(0, pool2_allocated(p));
+
+    pool2_destroy(p);
+}
+
+// Runs f in a child process and returns its exit status.
+template<typename F>
+int in_child(F &&f) {
+    const pid_t pid = fork();
+    if (!pid) {
+        _exit(f());
+    }
+
+    int status = -1;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+GTEST_TEST(pool2, shared_pool) {
+    const int fd = memfd_create("pool2", 0);
+    ASSERT_NE(-1, fd);
+    struct pool2 *p = pool2_create_shared(fd, 1024 * 1024);
+    ASSERT_NE(nullptr, p);
+    pool2_set_growth(p, POOL2_GROW_DOUBLE, 0);
+    EXPECT_EQ(nullptr, pool2_alloc(p, 2 * 1024 * 1024));
+
+    char *ping = static_cast<char *>(pool2_alloc(p, 100));
+    strcpy(ping, "ping");
+    const pool2_handle h = pool2_to_handle(p, ping);
+    EXPECT_EQ(0, pool2_to_handle(p, nullptr));
+    EXPECT_EQ(nullptr, pool2_from_handle(p, 0));
+
+    // The child maps the pool somewhere else, answers through the pool and
+    // frees the message it got.
+    int pipe_fds[2];
+    ASSERT_EQ(0, pipe(pipe_fds));
+    EXPECT_EQ(0, in_child([&] {
+        struct pool2 *q = pool2_attach(fd);
+        if (!q || q == p) {
+            return 1;
+        }
+
+        char *in = static_cast<char *>(pool2_from_handle(q, h));
+        char *pong = static_cast<char *>(pool2_alloc(q, 100));
+        snprintf(pong, 100, "%s pong", in);
+        pool2_free(q, in);
+
+        const pool2_handle reply = pool2_to_handle(q, pong);
+        const bool sent = write(pipe_fds[1], &reply, sizeof(reply))
+                == sizeof(reply);
+        pool2_destroy(q);
+        return sent ? 0 : 1;
+    }));
+
+    pool2_handle reply = 0;
+    ASSERT_EQ(sizeof(reply), read(pipe_fds[0], &reply, sizeof(reply)));
+    EXPECT_STREQ("ping pong",
+            static_cast<char *>(pool2_from_handle(p, reply)));
+    EXPECT_EQ(1, pool2_used_blocks(p));
+
+    pool2_free(p, pool2_from_handle(p, reply));
+    EXPECT_EQ(0, pool2_used_blocks(p));
+    EXPECT_EQ(1, pool2_free_blocks(p));
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    pool2_destroy(p);
+    close(fd);
+}
+
+GTEST_TEST(pool2, shared_pool_processes) {
+    constexpr auto processes = 4;
+    constexpr auto rounds = 10000;
+
+    const int fd = memfd_create("pool2", 0);
+    ASSERT_NE(-1, fd);
+    struct pool2 *p = pool2_create_shared(fd, 1024 * 1024);
+    ASSERT_NE(nullptr, p);
+
+    std::vector<pid_t> children{};
+    for (int n = 0; n < processes; ++n) {
+        const pid_t pid = fork();
+        if (!pid) {
+            struct pool2 *q = pool2_attach(fd);
+            auto rng{std::minstd_rand(n)};
+            std::vector<void *> live{};
+            for (int i = 0; i < rounds; ++i) {
+                if (live.size() < 64 && rng() % 2) {
+                    live.push_back(pool2_alloc(q, rng() % 1024));
+                } else if (!live.empty()) {
+                    pool2_free(q, live.back());
+                    live.pop_back();
+                }
+            }
+            for (void *ptr : live) {
+                pool2_free(q, ptr);
+            }
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+    for (pid_t pid : children) {
+        int status;
+        waitpid(pid, &status, 0);
+        EXPECT_TRUE(WIFEXITED(status));
+    }
+
+    struct pool2_stats stats;
+    pool2_get_stats(p, &stats);
+    EXPECT_EQ(0, stats.used_blocks);
+    EXPECT_EQ(0, stats.failures);
+    EXPECT_EQ(stats.allocs, stats.frees);
+    EXPECT_EQ(1, stats.free_blocks);
+
+    pool2_destroy(p);
+    close(fd);
+}
+
+// Walks hold the pool's lock while they call back, so a child that exits
+// from a callback dies holding it.
+void die_in_walk(struct pool2 *pool, void (*damage)(struct pool2 *)) {
+    struct walk {
+        struct pool2 *pool;
+        void (*damage)(struct pool2 *);
+    } w{pool, damage};
+    pool2_walk(pool, [](void *arg, const struct pool2_block *) {
+        const auto *w = static_cast<const struct walk *>(arg);
+        w->damage(w->pool);
+        _exit(0);
+    }, &w);
+}
+
+pool2_handle victim = 0;
+
+GTEST_TEST(pool2, shared_pool_with_a_dead_lock_holder) {
+    const int fd = memfd_create("pool2", 0);
+    ASSERT_NE(-1, fd);
+    struct pool2 *p = pool2_create_shared(fd, 1024 * 1024);
+    ASSERT_NE(nullptr, p);
+    void *block = pool2_alloc(p, 100);
+    ASSERT_NE(nullptr, block);
+    victim = pool2_to_handle(p, block);
+
+    // The pool is still whole, so the next lock takes it over.
+    EXPECT_EQ(0, in_child([&] {
+        die_in_walk(pool2_attach(fd), [](struct pool2 *) {});
+        return 1;
+    }));
+    void *other = pool2_alloc(p, 100);
+    EXPECT_NE(nullptr, other);
+    pool2_free(p, other);
+    EXPECT_EQ(1, pool2_used_blocks(p));
+
+    // The block's header is wiped before the child dies.
+    EXPECT_EQ(0, in_child([&] {
+        die_in_walk(pool2_attach(fd), [](struct pool2 *q) {
+            memset(static_cast<char *>(pool2_from_handle(q, victim)) - 8,
+                    0, 8);
+        });
+        return 1;
+    }));
+    EXPECT_EQ(nullptr, pool2_alloc(p, 100));
+    EXPECT_EQ(0, pool2_available(p));
+    pool2_free(p, block);
+    EXPECT_EQ(0, in_child([&] {
+        struct pool2 *q = pool2_attach(fd);
+        return q && !pool2_alloc(q, 100) ? 0 : 1;
+    }));
+
+    pool2_destroy(p);
+    close(fd);
+}
+
+GTEST_TEST(pool2, attach_checks_the_pool) {
+    const int fd = memfd_create("pool2", 0);
+    ASSERT_NE(-1, fd);
+    EXPECT_EQ(nullptr, pool2_attach(fd));
+    ASSERT_EQ(0, ftruncate(fd, 1024 * 1024));
+    EXPECT_EQ(nullptr, pool2_attach(fd));
+    close(fd);
+}
+
+// A path for a file that doesn't exist yet.
+std::string temp_path() {
+    char path[] = "/tmp/pool2_XXXXXX";
+    const int fd = mkstemp(path);
+    EXPECT_NE(-1, fd);
+    close(fd);
+    unlink(path);
+    return path;
+}
+
+struct node {
+    pool2_handle next;
+    int value;
+};
+
+GTEST_TEST(pool2, file_pool) {
+    const std::string path = temp_path();
+    const int file_fd = dup(0);
+    close(file_fd);
+    struct pool2 *p = pool2_open_file(path.c_str(), 1024 * 1024);
+    ASSERT_NE(nullptr, p);
+    EXPECT_EQ(0, pool2_root(p));
+
+    // A list of 0 to 99, linked by handles, with a hole after every block.
+    pool2_handle head = 0;
+    for (int n = 99; n >= 0; --n) {
+        node *item = static_cast<node *>(pool2_alloc(p, sizeof(node)));
+        ASSERT_NE(nullptr, item);
+        *item = {head, n};
+        head = pool2_to_handle(p, item);
+        pool2_free(p, pool2_alloc(p, 64));
+        pool2_alloc(p, 8);
+    }
+    pool2_set_root(p, head);
+    EXPECT_EQ(0, pool2_checkpoint(p));
+
+    // The file is locked while it's open, attaching to it still works.
+    EXPECT_EQ(nullptr, pool2_open_file(path.c_str(), 1024 * 1024));
+    const int fd = open(path.c_str(), O_RDWR);
+    ASSERT_NE(-1, fd);
+    struct pool2 *q = pool2_attach(fd);
+    ASSERT_NE(nullptr, q);
+    EXPECT_EQ(head, pool2_root(q));
+    pool2_destroy(q);
+    close(fd);
+    // Detaching leaves the descriptor the file was opened with alone, open
+    // takes the lowest free one.
+    EXPECT_NE(-1, fcntl(file_fd, F_GETFD));
+
+    struct pool2_stats before;
+    pool2_get_stats(p, &before);
+    pool2_destroy(p);
+
+    // The size only counts for new files.
+    p = pool2_open_file(path.c_str(), 4096);
+    ASSERT_NE(nullptr, p);
+    struct pool2_stats after;
+    pool2_get_stats(p, &after);
+    EXPECT_EQ(before.available, after.available);
+    EXPECT_EQ(before.allocated, after.allocated);
+    EXPECT_EQ(200, after.used_blocks);
+    EXPECT_EQ(before.free_blocks, after.free_blocks);
+
+    int expected = 0;
+    for (pool2_handle h = pool2_root(p); h; ++expected) {
+        const node *item = static_cast<node *>(pool2_from_handle(p, h));
+        EXPECT_EQ(expected, item->value);
+        h = item->next;
+    }
+    EXPECT_EQ(100, expected);
+
+    void *more = pool2_alloc(p, 1000);
+    EXPECT_NE(nullptr, more);
+    pool2_free(p, more);
+    pool2_destroy(p);
+    unlink(path.c_str());
+}
+
+GTEST_TEST(pool2, file_pool_checks_the_file) {
+    EXPECT_EQ(nullptr, pool2_open_file("/nonexistent/pool2", 1024 * 1024));
+
+    // Not a pool.
+    const std::string path = temp_path();
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    ASSERT_NE(-1, fd);
+    std::vector<char> junk(64 * 1024, 'x');
+    ASSERT_EQ(static_cast<ssize_t>(junk.size()),
+            write(fd, junk.data(), junk.size()));
+    close(fd);
+    EXPECT_EQ(nullptr, pool2_open_file(path.c_str(), 1024 * 1024));
+    unlink(path.c_str());
+
+    // A pool with a block that's been overwritten.
+    struct pool2 *p = pool2_open_file(path.c_str(), 1024 * 1024);
+    ASSERT_NE(nullptr, p);
+    const pool2_handle h = pool2_to_handle(p, pool2_alloc(p, 100));
+    pool2_alloc(p, 100);
+    EXPECT_EQ(0, pool2_checkpoint(p));
+    pool2_destroy(p);
+
+    p = pool2_open_file(path.c_str(), 0);
+    ASSERT_NE(nullptr, p);
+    pool2_destroy(p);
+
+    fd = open(path.c_str(), O_RDWR);
+    ASSERT_NE(-1, fd);
+    const std::uint64_t zero = 0;
+    ASSERT_EQ(static_cast<ssize_t>(sizeof(zero)),
+            pwrite(fd, &zero, sizeof(zero), h - sizeof(zero)));
+    close(fd);
+    EXPECT_EQ(nullptr, pool2_open_file(path.c_str(), 0));
+    unlink(path.c_str());
+
+    // Pools whose free list leads to a made-up block in the free space at
+    // the end of the file, one that reaches past the end of the file and
+    // one that looks fine but isn't where a block starts.
+    for (const std::uint64_t size : {512 * 1024, 2048}) {
+        p = pool2_open_file(path.c_str(), 1024 * 1024);
+        ASSERT_NE(nullptr, p);
+        pool2_alloc(p, 100);
+        void *hole = pool2_alloc(p, 100);
+        pool2_alloc(p, 100);
+        const pool2_handle free_block = pool2_to_handle(p, hole);
+        pool2_free(p, hole);
+        pool2_destroy(p);
+
+        fd = open(path.c_str(), O_RDWR);
+        ASSERT_NE(-1, fd);
+        const off_t end = lseek(fd, 0, SEEK_END);
+        const off_t fake = size < 4096 ? end - 4096 : end - 24;
+        // The header of the made-up block, then its links back to the hole.
+        const std::uint64_t block[] = {size, (free_block - 8) / 8 << 32};
+        ASSERT_EQ(static_cast<ssize_t>(sizeof(block)),
+                pwrite(fd, block, sizeof(block), fake));
+        // The one that fits in the file gets a matching footer.
+        if (size < 4096) {
+            ASSERT_EQ(static_cast<ssize_t>(sizeof(size)),
+                    pwrite(fd, &size, sizeof(size), fake + size - 8));
+        }
+        // The hole's links start with the one to the next free block.
+        const std::uint32_t next = fake / 8;
+        ASSERT_EQ(static_cast<ssize_t>(sizeof(next)),
+                pwrite(fd, &next, sizeof(next), free_block));
+        close(fd);
+        EXPECT_EQ(nullptr, pool2_open_file(path.c_str(), 0));
+        unlink(path.c_str());
+    }
+}
+
+GTEST_TEST(pool2, checkpoint_needs_a_file) {
+    struct pool2 *p = pool2_create(4096);
+    ASSERT_NE(nullptr, p);
+    EXPECT_EQ(-1, pool2_checkpoint(p));
+    pool2_destroy(p);
+}
+
 } // namespace
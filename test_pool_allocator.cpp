@@ -0,0 +1,133 @@
+#include "pool_allocator.h"
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+GTEST_TEST(pool_allocator, containers) {
+    struct good_pool *p = pool_create(1024 * 1024);
+    {
+        pools::good_pool_allocator<int> a{p};
+        std::vector<int, pools::good_pool_allocator<int>> v{a};
+        std::list<int, pools::good_pool_allocator<int>> l{a};
+        using pair_allocator =
+                pools::good_pool_allocator<std::pair<const int, int>>;
+        std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+                pair_allocator> m{0, std::hash<int>{}, std::equal_to<int>{},
+                pair_allocator{a}};
+        for (int i = 0; i < 1000; ++i) {
+            v.push_back(i);
+            l.push_back(i);
+            m.emplace(i, i);
+        }
+
+        EXPECT_EQ(1000, v.size());
+        EXPECT_EQ(1000, l.size());
+        EXPECT_EQ(999, m.at(999));
+        // Every list node and every map node is a block of its own.
+        EXPECT_GE(pool_used_blocks(p), 2000);
+    }
+    EXPECT_EQ(0, pool_used_blocks(p));
+    pool_destroy(p);
+}
+
+GTEST_TEST(pool_allocator, pool2_containers) {
+    struct pool2 *p = pool2_create(1024 * 1024);
+    {
+        pools::pool2_allocator<int> a{p};
+        std::map<int, int, std::less<int>,
+                pools::pool2_allocator<std::pair<const int, int>>> m{a};
+        for (int i = 0; i < 1000; ++i) m.emplace(i, i);
+        EXPECT_EQ(1000, pool2_used_blocks(p));
+    }
+    EXPECT_EQ(0, pool2_used_blocks(p));
+    pool2_destroy(p);
+}
+
+GTEST_TEST(pool_allocator, equality) {
+    struct good_pool *p = pool_create(4096);
+    struct good_pool *q = pool_create(4096);
+
+    pools::good_pool_allocator<int> a{p};
+    pools::good_pool_allocator<double> b{a};
+    EXPECT_EQ(p, b.pool());
+    EXPECT_TRUE(a == b);
+    EXPECT_TRUE(a != pools::good_pool_allocator<int>{q});
+
+    pool_destroy(q);
+    pool_destroy(p);
+}
+
+GTEST_TEST(pool_allocator, exhausted_pool) {
+    struct good_pool *p = pool_create(4096);
+    pools::good_pool_allocator<int> a{p};
+    EXPECT_THROW(a.allocate(4096), std::bad_alloc);
+    pool_destroy(p);
+}
+
+GTEST_TEST(pool_resource, pmr_containers) {
+    struct good_pool *p = pool_create(1024 * 1024);
+    struct pool2 *p2 = pool2_create(1024 * 1024);
+    pools::good_pool_resource r{p};
+    pools::pool2_resource r2{p2};
+    {
+        std::pmr::list<int> l{&r};
+        std::pmr::unordered_map<int, int> m{&r2};
+        for (int i = 0; i < 1000; ++i) {
+            l.push_back(i);
+            m.emplace(i, i);
+        }
+        EXPECT_GE(pool_used_blocks(p), 1000);
+        EXPECT_GE(pool2_used_blocks(p2), 1000);
+    }
+    EXPECT_EQ(0, pool_used_blocks(p));
+    EXPECT_EQ(0, pool2_used_blocks(p2));
+
+    pool2_destroy(p2);
+    pool_destroy(p);
+}
+
+GTEST_TEST(pool_resource, alignment) {
+    struct good_pool *p = pool_create(1024 * 1024);
+    struct pool2 *p2 = pool2_create(1024 * 1024);
+    pools::good_pool_resource r{p};
+    pools::pool2_resource r2{p2};
+
+    std::pmr::memory_resource *resources[] = {&r, &r2};
+    for (auto *m : resources) {
+        for (size_t align = 1; align <= 256; align *= 2) {
+            void *ptr = m->allocate(24, align);
+            EXPECT_EQ(0, reinterpret_cast<uintptr_t>(ptr) % align);
+            m->deallocate(ptr, 24, align);
+        }
+    }
+    EXPECT_EQ(0, pool_used_blocks(p));
+    EXPECT_EQ(0, pool2_used_blocks(p2));
+
+    pool2_destroy(p2);
+    pool_destroy(p);
+}
+
+GTEST_TEST(pool_resource, equality) {
+    struct good_pool *p = pool_create(4096);
+    struct good_pool *q = pool_create(4096);
+    pools::good_pool_resource r{p};
+
+    EXPECT_TRUE(r.is_equal(pools::good_pool_resource{p}));
+    EXPECT_FALSE(r.is_equal(pools::good_pool_resource{q}));
+    EXPECT_FALSE(r.is_equal(*std::pmr::new_delete_resource()));
+    EXPECT_THROW(static_cast<void>(r.allocate(8192)), std::bad_alloc);
+
+    pool_destroy(q);
+    pool_destroy(p);
+}
+
+} // namespace
@@ -0,0 +1,212 @@
+// pool_malloc.c is linked into this test, so everything in it, gtest
+// included, allocates from pools.
+
+#include "pool_trace.h"
+
+#include <malloc.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+std::uintptr_t address(const void *ptr) {
+    return reinterpret_cast<std::uintptr_t>(ptr);
+}
+
+bool aligned(const void *ptr, std::size_t align) {
+    return address(ptr) % align == 0;
+}
+
+GTEST_TEST(pool_malloc, malloc_and_free) {
+    // glibc would have room for 24 bytes.
+    void *small = malloc(1);
+    ASSERT_NE(nullptr, small);
+    EXPECT_EQ(16, malloc_usable_size(small));
+    free(small);
+
+    std::mt19937 rng{};
+    std::vector<unsigned char *> blocks{};
+    for (int n = 0; n < 10000; ++n) {
+        const std::size_t size = rng() % 1000;
+        auto *block = static_cast<unsigned char *>(malloc(size));
+        ASSERT_NE(nullptr, block);
+        EXPECT_TRUE(aligned(block, alignof(std::max_align_t)));
+        EXPECT_LE(size, malloc_usable_size(block));
+        memset(block, n & 0xff, size);
+        blocks.push_back(block);
+        if (rng() % 2) {
+            const std::size_t victim = rng() % blocks.size();
+            free(blocks[victim]);
+            blocks[victim] = blocks.back();
+            blocks.pop_back();
+        }
+    }
+    for (auto *block : blocks) {
+        free(block);
+    }
+    free(nullptr);
+}
+
+GTEST_TEST(pool_malloc, calloc) {
+    auto *dirty = static_cast<unsigned char *>(malloc(256));
+    ASSERT_NE(nullptr, dirty);
+    memset(dirty, 0xff, 256);
+    free(dirty);
+
+    auto *clean = static_cast<unsigned char *>(calloc(16, 16));
+    ASSERT_NE(nullptr, clean);
+    for (int n = 0; n < 256; ++n) {
+        EXPECT_EQ(0, clean[n]);
+    }
+    free(clean);
+
+    errno = 0;
+    EXPECT_EQ(nullptr, calloc(SIZE_MAX / 2, 4));
+    EXPECT_EQ(ENOMEM, errno);
+}
+
+GTEST_TEST(pool_malloc, realloc) {
+    auto *block = static_cast<unsigned char *>(realloc(nullptr, 10));
+    ASSERT_NE(nullptr, block);
+    for (int n = 0; n < 10; ++n) {
+        block[n] = n;
+    }
+
+    for (std::size_t size = 100; size < 100000; size *= 3) {
+        block = static_cast<unsigned char *>(realloc(block, size));
+        ASSERT_NE(nullptr, block);
+        EXPECT_TRUE(aligned(block, alignof(std::max_align_t)));
+        EXPECT_LE(size, malloc_usable_size(block));
+    }
+    block = static_cast<unsigned char *>(realloc(block, 5));
+    ASSERT_NE(nullptr, block);
+    for (int n = 0; n < 5; ++n) {
+        EXPECT_EQ(n, block[n]);
+    }
+
+    EXPECT_EQ(nullptr, realloc(block, 0));
+}
+
+GTEST_TEST(pool_malloc, aligned_allocations) {
+    for (std::size_t align = sizeof(void *); align <= 4096; align *= 2) {
+        void *ptr = nullptr;
+        ASSERT_EQ(0, posix_memalign(&ptr, align, 100));
+        EXPECT_TRUE(aligned(ptr, align));
+        free(ptr);
+
+        ptr = aligned_alloc(align, 3 * align);
+        ASSERT_NE(nullptr, ptr);
+        EXPECT_TRUE(aligned(ptr, align));
+        free(ptr);
+    }
+
+    void *ptr = nullptr;
+    EXPECT_EQ(EINVAL, posix_memalign(&ptr, 24, 100));
+    EXPECT_EQ(EINVAL, posix_memalign(&ptr, 2, 100));
+    EXPECT_EQ(nullptr, ptr);
+
+    ptr = valloc(1);
+    EXPECT_TRUE(aligned(ptr, 4096));
+    free(ptr);
+}
+
+// Blocks are handed from thread to thread, and every round of threads
+// takes over the pools of the round before.
+GTEST_TEST(pool_malloc, threads) {
+    constexpr int threads = 4;
+    constexpr int blocks = 5000;
+
+    std::vector<void *> last_round(threads * blocks);
+    std::vector<void *> this_round(threads * blocks);
+    for (int round = 0; round < 3; ++round) {
+        std::vector<std::thread> workers{};
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                std::mt19937 rng(t);
+                for (int n = 0; n < blocks; ++n) {
+                    free(last_round[(t + 1) % threads * blocks + n]);
+                    const std::size_t size = 1 + rng() % 200;
+                    void *block = malloc(size);
+                    ASSERT_NE(nullptr, block);
+                    memset(block, t, size);
+                    this_round[t * blocks + n] = block;
+                }
+            });
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        last_round.swap(this_round);
+    }
+
+    for (void *block : last_round) {
+        free(block);
+    }
+}
+
+#ifdef POOL_TRACING
+GTEST_TEST(pool_malloc, tracing) {
+    ASSERT_EQ(0, pool_trace_start(1 << 16));
+    void *ptr = malloc(100);
+    const std::uintptr_t first = address(ptr);
+    void *grown = realloc(ptr, 10000);
+    const std::uintptr_t second = address(grown);
+    void *other = nullptr;
+    std::uintptr_t third = 0;
+    std::thread([&] {
+        other = calloc(10, 10);
+        third = address(other);
+    }).join();
+    free(grown);
+    free(other);
+    pool_trace_stop();
+
+    FILE *f = tmpfile();
+    ASSERT_NE(nullptr, f);
+    ASSERT_EQ(0, pool_trace_write(f));
+    rewind(f);
+    struct pool_trace_header header;
+    ASSERT_EQ(1, fread(&header, sizeof(header), 1, f));
+    std::vector<struct pool_trace_event> events(header.count);
+    ASSERT_EQ(events.size(),
+            fread(events.data(), sizeof(events[0]), events.size(), f));
+    fclose(f);
+
+    // Whatever else the test allocated along the way is left out.
+    std::vector<struct pool_trace_event> ours{};
+    for (const auto &e : events) {
+        if (e.ptr == first || e.ptr == second || e.ptr == third) {
+            ours.push_back(e);
+        }
+    }
+    ASSERT_EQ(6, ours.size());
+    EXPECT_EQ(POOL_TRACE_ALLOC, ours[0].kind);
+    EXPECT_EQ(100, ours[0].size);
+    EXPECT_EQ(POOL_TRACE_FREE, ours[1].kind);
+    EXPECT_EQ(first, ours[1].ptr);
+    EXPECT_EQ(POOL_TRACE_ALLOC, ours[2].kind);
+    EXPECT_EQ(second, ours[2].ptr);
+    EXPECT_EQ(10000, ours[2].size);
+    EXPECT_EQ(POOL_TRACE_ALLOC, ours[3].kind);
+    EXPECT_EQ(100, ours[3].size);
+    EXPECT_NE(ours[0].thread, ours[3].thread);
+    EXPECT_EQ(POOL_TRACE_FREE, ours[4].kind);
+    EXPECT_EQ(POOL_TRACE_FREE, ours[5].kind);
+    EXPECT_EQ(ours[0].thread, ours[5].thread);
+    for (const auto &e : ours) {
+        EXPECT_EQ(0, e.pool);
+        EXPECT_NE(0, e.caller);
+    }
+}
+#endif
+
+} // namespace
@@ -0,0 +1,203 @@
+#include "numa_util.h"
+#include "numa_pool.h"
+#include "pool2.h"
+
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+GTEST_TEST(numa_util, nodes) {
+    const int nodes = numa_util_nodes();
+    ASSERT_GE(nodes, 1);
+    EXPECT_GE(numa_util_current_node(), 0);
+    EXPECT_LT(numa_util_current_node(), nodes);
+
+    const size_t page = sysconf(_SC_PAGESIZE);
+    void *mem = numa_util_map(page, nodes - 1);
+    ASSERT_NE(nullptr, mem);
+    memset(mem, 1, page);
+    EXPECT_EQ(-1, numa_util_bind(mem, page, nodes));
+    EXPECT_EQ(-1, numa_util_bind(mem, page, -1));
+    munmap(mem, page);
+
+    EXPECT_EQ(nullptr, numa_util_map(page, nodes));
+}
+
+GTEST_TEST(pool_numa, good_pool_on_node) {
+    const int node = numa_util_nodes() - 1;
+    EXPECT_EQ(nullptr, pool_create_on_node(4096, node + 1));
+
+    struct good_pool *p = pool_create_on_node(4096, node);
+    ASSERT_NE(nullptr, p);
+    pool_set_growth(p, POOL_GROW_DOUBLE, 0);
+
+    void *i = pool_alloc(p, 1000);
+    void *j = pool_alloc(p, 8000);
+    ASSERT_NE(nullptr, i);
+    ASSERT_NE(nullptr, j);
+    memset(j, 1, 8000);
+    EXPECT_EQ(1, pool_owns(p, i));
+    EXPECT_EQ(1, pool_owns(p, j));
+    EXPECT_EQ(0, pool_owns(p, &node));
+
+    pool_free(p, j);
+    pool_trim(p);
+    pool_free(p, i);
+    pool_destroy(p);
+
+    p = pool_create_shared_on_node(4096, node);
+    ASSERT_NE(nullptr, p);
+    pool_free(p, pool_alloc(p, 100));
+    pool_destroy(p);
+}
+
+GTEST_TEST(pool_numa, pool2_on_node) {
+    const int node = numa_util_nodes() - 1;
+    EXPECT_EQ(nullptr, pool2_create_on_node(4096, node + 1, 0));
+    EXPECT_EQ(nullptr, pool2_create_on_node(4096, -1, 0));
+
+    struct pool2 *p = pool2_create_on_node(1024 * 1024, node, 0);
+    ASSERT_NE(nullptr, p);
+    pool2_set_growth(p, POOL2_GROW_FIXED, 1024 * 1024);
+
+    std::vector<void *> ptrs{};
+    for (int n = 0; n < 3; ++n) {
+        void *ptr = pool2_alloc(p, 512 * 1024);
+        ASSERT_NE(nullptr, ptr);
+        memset(ptr, 1, 512 * 1024);
+        ptrs.push_back(ptr);
+    }
+    for (void *ptr : ptrs) {
+        pool2_free(p, ptr);
+    }
+    EXPECT_EQ(0, pool2_used_blocks(p));
+    pool2_destroy(p);
+}
+
+GTEST_TEST(numa_pool, threads) {
+    constexpr auto threads = 4;
+    constexpr auto allocs = 1000;
+
+    struct numa_pool *set = numa_pool_create(1024 * 1024);
+    ASSERT_NE(nullptr, set);
+    EXPECT_EQ(numa_util_nodes(), numa_pool_nodes(set));
+    EXPECT_EQ(nullptr, numa_pool_node(set, numa_pool_nodes(set)));
+
+    // Blocks are handed to another thread to be freed.
+    std::vector<void *> ptrs(threads * allocs);
+    std::vector<std::thread> workers{};
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (int i = 0; i < allocs; ++i) {
+                ptrs[t * allocs + i] = numa_pool_alloc(set, 64);
+            }
+        });
+    }
+    for (auto &w : workers) w.join();
+    workers.clear();
+
+    for (void *ptr : ptrs) {
+        ASSERT_NE(nullptr, ptr);
+    }
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (int i = 0; i < allocs; ++i) {
+                numa_pool_free(set, ptrs[(t + 1) % threads * allocs + i]);
+            }
+        });
+    }
+    for (auto &w : workers) w.join();
+
+    // Blocks can still sit in the thread caches of the threads that freed
+    // them, so only the pools' own counts are checked.
+    size_t allocs_counted = 0;
+    for (int node = 0; node < numa_pool_nodes(set); ++node) {
+        struct pool_stats stats;
+        pool_get_stats(numa_pool_node(set, node), &stats);
+        allocs_counted += stats.allocs;
+        EXPECT_EQ(stats.allocs, stats.frees);
+    }
+    EXPECT_EQ(threads * allocs, allocs_counted);
+    numa_pool_destroy(set);
+}
+
+GTEST_TEST(numa_pool, spills_to_other_nodes) {
+    struct numa_pool *set = numa_pool_create(4096);
+    ASSERT_NE(nullptr, set);
+
+    std::vector<void *> ptrs{};
+    while (void *ptr = numa_pool_alloc(set, 512)) {
+        ptrs.push_back(ptr);
+    }
+    // Every node's pool is used before allocations fail.
+    EXPECT_GE(ptrs.size(), 7 * numa_pool_nodes(set));
+    for (void *ptr : ptrs) {
+        numa_pool_free(set, ptr);
+    }
+    numa_pool_destroy(set);
+}
+
+// Makes mbind fail with EPERM in the calling process, like seccomp profiles
+// of containers do.
+bool refuse_mbind() {
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_mbind, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog program = {
+        static_cast<unsigned short>(sizeof(filter) / sizeof(filter[0])),
+        filter,
+    };
+    return !prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0)
+            && !prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program);
+}
+
+GTEST_TEST(numa_pool, works_without_mbind) {
+    const pid_t pid = fork();
+    ASSERT_NE(-1, pid);
+    if (!pid) {
+        if (!refuse_mbind()) {
+            _exit(2);
+        }
+        // Binding fails on every node, node 0 included.
+        const size_t page = sysconf(_SC_PAGESIZE);
+        if (numa_util_map(page, 0)) {
+            _exit(3);
+        }
+
+        struct numa_pool *set = numa_pool_create(64 * 1024);
+        if (!set) {
+            _exit(1);
+        }
+        void *ptr = numa_pool_alloc(set, 100);
+        numa_pool_free(set, ptr);
+        numa_pool_destroy(set);
+        _exit(ptr ? 0 : 1);
+    }
+
+    int status = -1;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    ASSERT_TRUE(WIFEXITED(status));
+    if (WEXITSTATUS(status) == 2) {
+        GTEST_SKIP() << "seccomp isn't available";
+    }
+    EXPECT_EQ(0, WEXITSTATUS(status));
+}
+
+} // namespace
@@ -0,0 +1,65 @@
+#include "pool_snapshot.h"
+
+#include <cstdio>
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+std::string read_all(FILE *f) {
+    std::string contents{};
+    rewind(f);
+    for (int c; (c = fgetc(f)) != EOF;) {
+        contents.push_back(static_cast<char>(c));
+    }
+    return contents;
+}
+
+GTEST_TEST(pool_snapshot, good_pool) {
+    struct good_pool *p = pool_create(4096);
+    void *i = pool_alloc(p, 100);
+    void *j = pool_alloc(p, 200);
+    pool_free(p, i);
+
+    FILE *f = tmpfile();
+    ASSERT_NE(nullptr, f);
+    EXPECT_EQ(0, pool_write_snapshot(p, f));
+
+    unsigned arena;
+    size_t offset, size, total = 0;
+    int in_use, blocks = 0, used = 0;
+    rewind(f);
+    while (fscanf(f, "%u %zu %zu %d", &arena, &offset, &size, &in_use) == 4) {
+        EXPECT_EQ(0, arena);
+        EXPECT_EQ(total, offset);
+        total += size;
+        used += in_use;
+        ++blocks;
+    }
+    EXPECT_EQ(4096, total);
+    EXPECT_EQ(3, blocks);
+    EXPECT_EQ(1, used);
+
+    fclose(f);
+    pool_free(p, j);
+    pool_destroy(p);
+}
+
+GTEST_TEST(pool_snapshot, pool2_with_arenas) {
+    struct pool2 *p = pool2_create(1024);
+    pool2_set_growth(p, POOL2_GROW_FIXED, 4096);
+    void *i = pool2_alloc(p, 2000);
+    ASSERT_NE(nullptr, i);
+
+    FILE *f = tmpfile();
+    ASSERT_NE(nullptr, f);
+    EXPECT_EQ(0, pool2_write_snapshot(p, f));
+    EXPECT_EQ("0 0 1024 0\n1 0 2016 1\n1 2016 2080 0\n", read_all(f));
+
+    fclose(f);
+    pool2_free(p, i);
+    pool2_destroy(p);
+}
+
+} // namespace
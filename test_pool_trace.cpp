@@ -0,0 +1,218 @@
+#include "pool_trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#ifdef POOL_TRACING
+#include "good_pool.h"
+#include "pool2.h"
+#endif
+
+namespace {
+
+struct trace {
+    struct pool_trace_header header;
+    std::vector<struct pool_trace_event> events;
+};
+
+trace write_trace() {
+    trace t{};
+    FILE *f = tmpfile();
+    EXPECT_NE(nullptr, f);
+    EXPECT_EQ(0, pool_trace_write(f));
+
+    rewind(f);
+    struct pool_trace_event *events;
+    EXPECT_EQ(0, pool_trace_read(f, &t.header, &events));
+    if (events) {
+        t.events.assign(events, events + t.header.count);
+    }
+    free(events);
+    fclose(f);
+    return t;
+}
+
+GTEST_TEST(pool_trace, keeps_the_last_events) {
+    ASSERT_EQ(0, pool_trace_start(3));
+    EXPECT_EQ(-1, pool_trace_start(3));
+    int x[6];
+    for (int &i : x) {
+        pool_trace_record(POOL_TRACE_ALLOC, nullptr, &i, sizeof(i), nullptr);
+    }
+    pool_trace_stop();
+    pool_trace_record(POOL_TRACE_FREE, nullptr, &x[0], 0, nullptr);
+
+    const trace t = write_trace();
+    EXPECT_STREQ(POOL_TRACE_MAGIC, t.header.magic);
+    EXPECT_EQ(sizeof(struct pool_trace_event), t.header.event_size);
+    ASSERT_EQ(4, t.header.count);
+    EXPECT_EQ(2, t.header.dropped);
+    for (size_t n = 0; n < t.events.size(); ++n) {
+        EXPECT_EQ(n + 2, t.events[n].seq);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(&x[n + 2]), t.events[n].ptr);
+        EXPECT_EQ(POOL_TRACE_ALLOC, t.events[n].kind);
+        EXPECT_EQ(sizeof(int), t.events[n].size);
+    }
+    EXPECT_LE(t.events[0].time, t.events[3].time);
+}
+
+GTEST_TEST(pool_trace, read_checks_the_trace) {
+    FILE *f = tmpfile();
+    ASSERT_NE(nullptr, f);
+    const char junk[64] = "not a trace";
+    ASSERT_EQ(1, fwrite(junk, sizeof(junk), 1, f));
+    rewind(f);
+
+    struct pool_trace_header header;
+    struct pool_trace_event *events;
+    EXPECT_EQ(-1, pool_trace_read(f, &header, &events));
+    EXPECT_EQ(nullptr, events);
+    fclose(f);
+}
+
+GTEST_TEST(pool_trace, threads) {
+    constexpr size_t threads = 4;
+    constexpr size_t events = 10000;
+
+    ASSERT_EQ(0, pool_trace_start(threads * events));
+    std::vector<std::thread> workers{};
+    for (size_t n = 0; n < threads; ++n) {
+        workers.emplace_back([] {
+            int x;
+            for (size_t i = 0; i < events; ++i) {
+                pool_trace_record(POOL_TRACE_ALLOC, nullptr, &x, 1, nullptr);
+            }
+        });
+    }
+    for (auto &w : workers) w.join();
+    pool_trace_stop();
+
+    const trace t = write_trace();
+    EXPECT_EQ(threads * events, t.header.count);
+    EXPECT_EQ(0, t.header.dropped);
+    std::map<uint32_t, size_t> per_thread{};
+    for (size_t n = 0; n < t.events.size(); ++n) {
+        EXPECT_EQ(n, t.events[n].seq);
+        ++per_thread[t.events[n].thread];
+    }
+    EXPECT_EQ(threads, per_thread.size());
+    for (const auto &[thread, count] : per_thread) {
+        EXPECT_NE(0, thread);
+        EXPECT_EQ(events, count);
+    }
+}
+
+#ifdef POOL_TRACING
+GTEST_TEST(pool_trace, pools) {
+    struct good_pool *p = pool_create(4096);
+    struct pool2 *p2 = pool2_create(4096);
+
+    ASSERT_EQ(0, pool_trace_start(16));
+    void *i = pool_alloc(p, 100);
+    void *j = pool2_alloc(p2, 200);
+    pool_free(p, i);
+    pool2_free(p2, j);
+    pool_trace_stop();
+
+    const trace t = write_trace();
+    ASSERT_EQ(4, t.header.count);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(p), t.events[0].pool);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(i), t.events[0].ptr);
+    EXPECT_EQ(100, t.events[0].size);
+    EXPECT_EQ(POOL_TRACE_ALLOC, t.events[0].kind);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(p2), t.events[1].pool);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(j), t.events[1].ptr);
+    EXPECT_EQ(200, t.events[1].size);
+    EXPECT_EQ(POOL_TRACE_FREE, t.events[2].kind);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(i), t.events[2].ptr);
+    EXPECT_EQ(POOL_TRACE_FREE, t.events[3].kind);
+    EXPECT_NE(0, t.events[0].caller);
+
+    pool2_destroy(p2);
+    pool_destroy(p);
+}
+
+// Every call from one of these records the same caller, whatever the pool
+// does inside. The empty asm keeps the calls from becoming jumps, which
+// would leave the test as the caller.
+__attribute__((noinline)) void *realloc_here(
+        struct good_pool *p, void *ptr, size_t size) {
+    void *result = pool_realloc(p, ptr, size);
+    asm volatile("" : : "r"(result));
+    return result;
+}
+
+__attribute__((noinline)) void *aligned_here(
+        struct good_pool *p, size_t size, size_t align) {
+    void *result = pool_alloc_aligned(p, size, align);
+    asm volatile("" : : "r"(result));
+    return result;
+}
+
+__attribute__((noinline)) void *realloc2_here(
+        struct pool2 *p, void *ptr, size_t size) {
+    void *result = pool2_realloc(p, ptr, size);
+    asm volatile("" : : "r"(result));
+    return result;
+}
+
+__attribute__((noinline)) void *aligned2_here(
+        struct pool2 *p, size_t size, size_t align) {
+    void *result = pool2_alloc_aligned(p, size, align);
+    asm volatile("" : : "r"(result));
+    return result;
+}
+
+// The calls record where they were called from, even the ones that are
+// built on other calls.
+GTEST_TEST(pool_trace, callers) {
+    struct good_pool *p = pool_create(64 * 1024);
+    struct pool2 *p2 = pool2_create(64 * 1024);
+
+    // A new block that grows in place, moves past the block after it and is
+    // freed, then blocks with small and large alignments.
+    ASSERT_EQ(0, pool_trace_start(64));
+    void *i = realloc_here(p, nullptr, 100);
+    i = realloc_here(p, i, 200);
+    void *wall = realloc_here(p, nullptr, 8);
+    i = realloc_here(p, i, 1000);
+    realloc_here(p, i, 0);
+    realloc_here(p, wall, 0);
+    void *small = aligned_here(p, 100, 8);
+    void *large = aligned_here(p, 100, 64);
+
+    void *j = realloc2_here(p2, nullptr, 100);
+    j = realloc2_here(p2, j, 200);
+    void *wall2 = realloc2_here(p2, nullptr, 8);
+    j = realloc2_here(p2, j, 1000);
+    realloc2_here(p2, j, 0);
+    realloc2_here(p2, wall2, 0);
+    void *small2 = aligned2_here(p2, 100, 8);
+    void *large2 = aligned2_here(p2, 100, 64);
+    pool_trace_stop();
+
+    const trace t = write_trace();
+    ASSERT_EQ(20, t.header.count);
+    for (size_t n = 0; n < 20; n += 10) {
+        for (size_t k = n; k < n + 8; ++k) {
+            EXPECT_EQ(t.events[n].caller, t.events[k].caller) << k;
+        }
+        EXPECT_EQ(t.events[n + 8].caller, t.events[n + 9].caller) << n;
+        EXPECT_NE(t.events[n].caller, t.events[n + 8].caller) << n;
+    }
+
+    pool_free(p, small);
+    pool_free(p, large);
+    pool2_free(p2, small2);
+    pool2_free(p2, large2);
+    pool2_destroy(p2);
+    pool_destroy(p);
+}
+#endif
+
+} // namespace
@@ -0,0 +1,86 @@
+#include "static_pool.h"
+
+#include <cstdint>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using small_pool = pools::static_pool<4096, 16, 64, 256>;
+
+// Nothing runs to set this up, it's zero-initialized like any other static.
+small_pool pool{};
+
+std::vector<struct pool2_block> walk(const small_pool &p) {
+    std::vector<struct pool2_block> blocks{};
+    p.walk([](void *arg, const struct pool2_block *block) {
+        static_cast<std::vector<struct pool2_block> *>(arg)->push_back(*block);
+    }, &blocks);
+    return blocks;
+}
+
+GTEST_TEST(static_pool, size_classes) {
+    EXPECT_EQ(256, pool.max_alloc_size());
+
+    void *i = pool.alloc(1);
+    void *j = pool.alloc(17);
+    void *k = pool.alloc<200>();
+    EXPECT_EQ(nullptr, pool.alloc(257));
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(i) % 8);
+    EXPECT_EQ(3, pool.used_blocks());
+
+    // Blocks carry 16 bytes of header and footer.
+    const auto blocks = walk(pool);
+    ASSERT_EQ(4, blocks.size());
+    EXPECT_EQ(32, blocks[0].size);
+    EXPECT_EQ(80, blocks[1].size);
+    EXPECT_EQ(272, blocks[2].size);
+    EXPECT_EQ(4096 - 32 - 80 - 272, blocks[3].size);
+    EXPECT_EQ(0, blocks[3].in_use);
+    EXPECT_EQ(1, blocks[0].in_use);
+
+    // Freed blocks are handed out again for their class.
+    pool.free(j);
+    EXPECT_EQ(j, pool.alloc(64));
+    pool.free(i);
+    pool.free(j);
+    pool.free(k);
+    EXPECT_EQ(0, pool.used_blocks());
+}
+
+GTEST_TEST(static_pool, full_arena) {
+    auto *p = new small_pool{};
+
+    std::vector<void *> big{};
+    while (void *ptr = p->alloc(256)) {
+        big.push_back(ptr);
+    }
+    // 15 blocks of 272 bytes fill all but 16 bytes.
+    ASSERT_EQ(15, big.size());
+    EXPECT_EQ(nullptr, p->alloc(1));
+
+    // Small requests fall back to free blocks of bigger classes.
+    p->free(big.back());
+    void *small = p->alloc(8);
+    EXPECT_EQ(big.back(), small);
+    EXPECT_EQ(nullptr, p->alloc(8));
+
+    const auto blocks = walk(*p);
+    ASSERT_EQ(16, blocks.size());
+    for (size_t n = 0; n < 15; ++n) {
+        EXPECT_EQ(272, blocks[n].size);
+        EXPECT_EQ(1, blocks[n].in_use);
+    }
+    EXPECT_EQ(16, blocks[15].size);
+
+    p->free(small);
+    big.pop_back();
+    for (void *ptr : big) {
+        p->free(ptr);
+    }
+    EXPECT_EQ(0, p->used_blocks());
+    delete p;
+}
+
+} // namespace